@@ -0,0 +1,233 @@
+#include "btree.hpp"
+#include "wal.hpp"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <glog/logging.h>  // yum install glog glog-devel
+#include <gflags/gflags.h> // yum install gflags gflags-devel
+
+DEFINE_string(locks, "tas,ttas,rw,optimistic", "comma separated list of page locks to compare");
+DEFINE_int32(max_threads, 8, "the thread count is doubled from 1 up to this");
+DEFINE_int32(num_ops, 200000, "number of operations of each thread");
+DEFINE_int32(key_range, 64, "keys are drawn from [0, key_range), a small range keeps the threads on the same leaves");
+DEFINE_int32(read_percent, 50, "percentage of the operations that are point searches");
+DEFINE_int32(seed, 42, "random seed");
+DEFINE_string(wal, "", "path of a write-ahead log, when set the threads insert through a logged_btree instead of comparing the locks");
+DEFINE_int32(wal_ops, 2000, "number of logged inserts of each thread");
+
+// every thread inserts or searches random keys of a small range, like the
+// insert threads of task.cpp that all hit the same leaf
+template <typename Lock>
+static void worker(basic_btree<Lock> *bt, int id)
+{
+    std::mt19937_64 rng(FLAGS_seed + id);
+    for (int i = 0; i < FLAGS_num_ops; i++)
+    {
+        entry_key_t key = rng() % FLAGS_key_range;
+        if ((int)(rng() % 100) < FLAGS_read_percent)
+            bt->btree_search(key);
+        else
+            bt->btree_insert(key, (char *)(uintptr_t)(key + 1));
+    }
+}
+
+template <typename Lock>
+static void bench(const char *name)
+{
+    for (int threads = 1; threads <= FLAGS_max_threads; threads *= 2)
+    {
+        basic_btree<Lock> *bt = new basic_btree<Lock>();
+        // every key is in the tree, so searches do not print NOT FOUND
+        for (int key = 0; key < FLAGS_key_range; key++)
+            bt->btree_insert(key, (char *)(uintptr_t)(key + 1));
+
+        auto start = std::chrono::steady_clock::now();
+        vector<std::thread> vthreads;
+        for (int i = 0; i < threads; i++)
+            vthreads.push_back(std::thread(worker<Lock>, bt, i));
+        for (auto &u : vthreads)
+            u.join();
+        double ns = std::chrono::duration<double, std::nano>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+
+        long ops = (long)threads * FLAGS_num_ops;
+        printf("%-10s %3d threads %12.1f ns/op %12.0f ops/s\n", name, threads,
+               ns / ops, ops * 1e9 / ns);
+        delete bt;
+    }
+}
+
+// every thread inserts random keys through the log, each insert waits for
+// its commit
+static void wal_worker(logged_btree *bt, int id, vector<double> *latencies)
+{
+    std::mt19937_64 rng(FLAGS_seed + id);
+    for (int i = 0; i < FLAGS_wal_ops; i++)
+    {
+        entry_key_t key = rng() % 1000000000;
+        auto start = std::chrono::steady_clock::now();
+        bt->btree_insert(key, (char *)(key + 1));
+        latencies->push_back(std::chrono::duration<double, std::micro>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count());
+    }
+}
+
+// inserts like wal_worker and deletes every other time, from keys that
+// repeat and values that do not, so the deletes pick among equal keys
+static void wal_churn_worker(logged_btree *bt, int id)
+{
+    std::mt19937_64 rng(FLAGS_seed + id);
+    for (int i = 0; i < FLAGS_wal_ops; i++)
+    {
+        uint64_t value = ((uint64_t)id << 32 | i) + 1;
+        bt->btree_insert(rng() % FLAGS_wal_ops, (char *)value);
+        if (i % 2 == 1)
+            bt->btree_delete(rng() % FLAGS_wal_ops);
+    }
+}
+
+// the entries of the tree, sorted also by value as equal keys may be in any
+// order
+static vector<std::pair<entry_key_t, char *>> wal_entries(logged_btree *bt)
+{
+    vector<std::pair<entry_key_t, char *>> entries;
+    bt->tree()->btree_scan(LLONG_MIN, LLONG_MAX, true, true,
+                           [&](entry_key_t key, char *value)
+                           {
+                               entries.push_back({key, value});
+                               return true;
+                           });
+    std::sort(entries.begin(), entries.end());
+    return entries;
+}
+
+// group commit: throughput, records per fdatasync and commit latency as the
+// thread count doubles, then the time to rebuild the tree from the log, with
+// and without a checkpoint. Each restart must give back the entries of the
+// tree that was closed.
+static void bench_wal(const char *path)
+{
+    vector<std::pair<entry_key_t, char *>> entries;
+    for (int threads = 1; threads <= FLAGS_max_threads; threads *= 2)
+    {
+        unlink(path);
+        logged_btree *bt = new logged_btree();
+        string error;
+        if (!bt->open(path, error))
+            LOG(FATAL) << error;
+
+        auto start = std::chrono::steady_clock::now();
+        vector<vector<double>> latencies(threads);
+        vector<std::thread> vthreads;
+        for (int i = 0; i < threads; i++)
+            vthreads.push_back(std::thread(wal_worker, bt, i, &latencies[i]));
+        for (auto &u : vthreads)
+            u.join();
+        double s = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+        vector<double> all;
+        for (auto &l : latencies)
+            all.insert(all.end(), l.begin(), l.end());
+        std::sort(all.begin(), all.end());
+        wal_stats st = bt->wal().stats();
+        printf("wal %3d threads %10.0f inserts/s %8.1f records/sync "
+               "p50 %8.1f us p99 %8.1f us max %8.1f us\n",
+               threads, all.size() / s, (double)st.records / st.syncs,
+               all[all.size() / 2], all[all.size() * 99 / 100], all.back());
+        entries = wal_entries(bt);
+        delete bt;
+    }
+
+    logged_btree *bt = new logged_btree();
+    string error;
+    auto start = std::chrono::steady_clock::now();
+    if (!bt->open(path, error))
+        LOG(FATAL) << error;
+    double ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    printf("recovery %lu records %10.1f ms\n",
+           (unsigned long)bt->wal().last_lsn(), ms);
+    if (wal_entries(bt) != entries)
+        LOG(FATAL) << "the tree recovered from " << path << " differs";
+
+    // a checkpoint while the threads insert and delete as many keys again,
+    // when 90% of the records are in, then a restart from the snapshot and
+    // the log after it
+    string snapshot = string(path) + ".snapshot";
+    unlink(snapshot.c_str());
+    uint64_t target = bt->wal().last_lsn() +
+                      (uint64_t)FLAGS_max_threads * FLAGS_wal_ops * 9 / 10;
+    vector<std::thread> vthreads;
+    for (int i = 0; i < FLAGS_max_threads; i++)
+        vthreads.push_back(
+            std::thread(wal_churn_worker, bt, FLAGS_max_threads + i));
+    while (bt->wal().last_lsn() < target)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    start = std::chrono::steady_clock::now();
+    if (!bt->checkpoint(snapshot.c_str(), error))
+        LOG(FATAL) << error;
+    ms = std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+             .count();
+    for (auto &u : vthreads)
+        u.join();
+    struct stat st;
+    stat(snapshot.c_str(), &st);
+    printf("checkpoint %10.1f ms, snapshot %.1f MB\n", ms, st.st_size / 1e6);
+    entries = wal_entries(bt);
+    delete bt;
+
+    bt = new logged_btree();
+    start = std::chrono::steady_clock::now();
+    if (!bt->open(path, snapshot.c_str(), error))
+        LOG(FATAL) << error;
+    ms = std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+             .count();
+    printf("recovery from the snapshot and %lu records %10.1f ms\n",
+           (unsigned long)(bt->wal().last_lsn() - bt->wal().first_lsn() + 1),
+           ms);
+    if (wal_entries(bt) != entries)
+        LOG(FATAL) << "the tree recovered from " << snapshot << " differs";
+    delete bt;
+}
+
+int main(int argc, char *argv[])
+{
+    google::ParseCommandLineFlags(&argc, &argv, true);
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_log_dir = "./logs";
+
+    if (!FLAGS_wal.empty())
+    {
+        bench_wal(FLAGS_wal.c_str());
+        return 0;
+    }
+
+    printf("page size: %d, cardinality: %d, key range: %d, reads: %d%%\n",
+           PAGESIZE, cardinality, FLAGS_key_range, FLAGS_read_percent);
+
+    std::stringstream locks(FLAGS_locks);
+    string name;
+    while (std::getline(locks, name, ','))
+    {
+        if (name == "tas")
+            bench<spinlock>("tas");
+        else if (name == "ttas")
+            bench<ttas_spinlock>("ttas");
+        else if (name == "rw")
+            bench<rw_spinlock>("rw");
+        else if (name == "optimistic")
+            bench<version_lock>("optimistic");
+        else
+            LOG(ERROR) << "unknown lock: " << name << endl;
+    }
+    return 0;
+}
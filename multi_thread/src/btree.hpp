@@ -1,3 +1,7 @@
+#ifndef BTREE_HPP
+#define BTREE_HPP
+
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <iostream>
@@ -10,74 +14,122 @@
 #include <unistd.h>
 #include <vector>
 #include <atomic>
+#include "spinlock.hpp"
 
+#ifndef PAGESIZE
 #define PAGESIZE 128
+#endif
+
+// The slots of a page are scanned linearly unless BINARY_SEARCH or SIMD_SEARCH
+// is defined, both of which rank the key among the sorted slots instead.
+#ifdef SIMD_SEARCH
+#include "simd_search.hpp"
+#endif
+#if defined(BINARY_SEARCH) || defined(SIMD_SEARCH)
+#define RANK_SEARCH
+#endif
+
+// btree_search_batch walks this many keys through the tree in lockstep and
+// prefetches up to SEARCH_PREFETCH_BYTES of every page it is about to search
+#ifndef SEARCH_BATCH_GROUP
+#define SEARCH_BATCH_GROUP 32
+#endif
+#define SEARCH_PREFETCH_BYTES 512
+
+static inline void prefetch_page(const void *p)
+{
+  for (int off = 0; off < std::min(PAGESIZE, SEARCH_PREFETCH_BYTES); off += 64)
+    __builtin_prefetch((const char *)p + off);
+}
 
 using entry_key_t = int64_t;
+
+// the predicate of btree_scan, btree_scan_where takes any callable
+// bool(entry_key_t key, char *ptr) instead
+struct accept_all
+{
+  bool operator()(entry_key_t, char *) const { return true; }
+};
 using namespace std;
 
-class page;
+// the lock of the btree typedef, any lock of spinlock.hpp can be passed to
+// basic_btree directly
+#ifdef OPTIMISTIC_LOCK
+typedef version_lock page_lock;
+#else
+typedef spinlock page_lock;
+#endif
 
-// spin lock
-class spinlock{
-private:
-  std::atomic_flag flag;
-public:
-  spinlock() : flag(ATOMIC_FLAG_INIT) {}
-  void lock() {
-    while (flag.test_and_set(::std::memory_order_acquire));
-  }
-  void unlock() {
-    flag.clear(::std::memory_order_release);
-  }
-};
+template <typename Lock> class basic_page;
 
-class btree
+template <typename Lock>
+class basic_btree
 {
 private:
+  typedef basic_page<Lock> page;
+
   int height;
   char *root;
 
+  page *bulk_leaf(const entry_key_t *, char *const *, size_t, size_t);
+  void bulk_build_levels(vector<page *> &, vector<entry_key_t> &, double);
+
 public:
-  btree();
+  basic_btree();
   void setNewRoot(char *);
   void btree_insert(entry_key_t, char *);
   void btree_insert_internal(char *, entry_key_t, char *, uint32_t);
   void btree_delete(entry_key_t);
+  bool btree_delete(entry_key_t, char *);
   void btree_delete_internal(entry_key_t, char *, uint32_t, entry_key_t *,
                              bool *, page **);
   char *btree_search(entry_key_t);
+  void btree_search_batch(const entry_key_t *, size_t, char **);
   void btree_search_range(entry_key_t, entry_key_t, unsigned long *, int &);
-
-  friend class page;
+  template <typename Visitor>
+  void btree_scan(entry_key_t, entry_key_t, bool, bool, Visitor);
+  template <typename Predicate, typename Visitor>
+  void btree_scan_where(entry_key_t, entry_key_t, bool, bool, Predicate,
+                        Visitor);
+  template <typename Visitor>
+  void btree_scan_reverse(entry_key_t, entry_key_t, bool, bool, Visitor);
+  void btree_bulk_load(const entry_key_t *, char *const *, size_t,
+                       double fill_factor = 1.0);
+  void btree_insert_batch(const entry_key_t *, char *const *, size_t);
+
+  template <typename> friend class basic_page;
 };
 
-class header
+template <typename Lock>
+class basic_header
 {
 private:
+  typedef basic_page<Lock> page;
+
   page *leftmost_ptr;     // 8 bytes
   page *sibling_ptr;      // 8 bytes
+  page *prev_ptr;         // 8 bytes, left sibling
   uint32_t level;         // 4 bytes
   uint8_t switch_counter; // 1 bytes
   uint8_t is_deleted;     // 1 bytes
   int16_t last_index;     // 2 bytes
-  spinlock *splk;         // 8 bytes
+  Lock latch;             // 8 bytes
 
-  friend class page;
-  friend class btree;
+  template <typename> friend class basic_page;
+  template <typename> friend class basic_btree;
 
 public:
-  header()
+  basic_header()
   {
-    splk = new spinlock();
     leftmost_ptr = nullptr;
     sibling_ptr = nullptr;
+    prev_ptr = nullptr;
     switch_counter = 0;
     last_index = -1;
     is_deleted = false;
   }
 
-  ~header(){delete splk;};
+  ~basic_header() {}
 };
 
 class entry
@@ -93,29 +145,76 @@ public:
     ptr = nullptr;
   }
 
-  friend class page;
-  friend class btree;
+  template <typename> friend class basic_page;
+  template <typename> friend class basic_btree;
+};
+
+// the header has the same size with every lock
+const int cardinality =
+    (PAGESIZE - sizeof(basic_header<spinlock>)) / sizeof(entry);
+
+#ifdef SOA_PAGE
+// Structure of arrays slots: the keys of a page are contiguous and followed
+// by the pointers, so a search only pulls the key cache lines. records[i]
+// returns references to both halves of slot i, so records[i].key and
+// records[i].ptr read and write the same way as with the entry array.
+class soa_slots
+{
+private:
+  entry_key_t keys[cardinality]; // 8 bytes * n
+  char *ptrs[cardinality];       // 8 bytes * n
+
+public:
+  struct slot
+  {
+    entry_key_t &key;
+    char *&ptr;
+  };
+
+  soa_slots()
+  {
+    for (int i = 0; i < cardinality; i++)
+    {
+      keys[i] = LONG_MAX;
+      ptrs[i] = nullptr;
+    }
+  }
+
+  inline slot operator[](int i) { return slot{keys[i], ptrs[i]}; }
 };
 
-const int cardinality = (PAGESIZE - sizeof(header)) / sizeof(entry);
+typedef soa_slots slot_array;
+const int key_stride = 1; // distance between two keys in entry_key_t
+#else
+typedef entry slot_array[cardinality];
+const int key_stride = sizeof(entry) / sizeof(entry_key_t);
+#endif
 
-class page
+template <typename Lock>
+class basic_page
 {
 private:
-  header hdr;                 // header in memory, 16 bytes
-  entry records[cardinality]; // slots in memory, 16 bytes * n
+  typedef basic_page page;
+  typedef basic_btree<Lock> btree;
+  typedef basic_header<Lock> header;
+
+  header hdr;                 // header in memory, 40 bytes
+  slot_array records;         // slots in memory, 16 bytes * n
+
+  static_assert(sizeof(header) == sizeof(basic_header<spinlock>),
+                "the page lock does not fit in the header");
 
 public:
-  friend class btree;
+  friend class basic_btree<Lock>;
 
-  page(uint32_t level = 0)
+  basic_page(uint32_t level = 0)
   {
     hdr.level = level;
     records[0].ptr = nullptr;
   }
 
   // this is called when tree grows
-  page(page *left, entry_key_t key, page *right, uint32_t level = 0)
+  basic_page(page *left, entry_key_t key, page *right, uint32_t level = 0)
   {
     hdr.leftmost_ptr = left;
     hdr.level = level;
@@ -164,7 +263,34 @@ public:
     return count;
   }
 
-  inline bool remove_key(entry_key_t key)
+#ifdef RANK_SEARCH
+  // Number of slots in [0, num_entries) whose key is less than key, or less
+  // than or equal to key if inclusive is set. Keys stay non-decreasing while
+  // insert_key shifts entries, so the result is well defined for readers too.
+  inline int rank(entry_key_t key, int num_entries, bool inclusive)
+  {
+#ifdef SIMD_SEARCH
+    return simd_rank<key_stride>(&records[0].key, num_entries, key,
+                                 inclusive);
+#else
+    // branch free: the halving is compiled to conditional moves
+    int lo = 0, n = num_entries;
+    while (n > 0)
+    {
+      int half = n >> 1;
+      entry_key_t k = records[lo + half].key;
+      bool right = (k < key) | (inclusive & (k == key));
+      lo = right ? lo + half + 1 : lo;
+      n = right ? n - half - 1 : half;
+    }
+    return lo;
+#endif
+  }
+#endif
+
+  // removes the first entry of key, only the one with ptr if it is not
+  // nullptr
+  inline bool remove_key(entry_key_t key, char *ptr = nullptr)
   {
     if (hdr.switch_counter % 2 == 0)
       ++hdr.switch_counter;
@@ -173,7 +299,8 @@ public:
     int i;
     for (i = 0; records[i].ptr != nullptr; ++i)
     {
-      if (!shift && records[i].key == key)
+      if (!shift && records[i].key == key &&
+          (ptr == nullptr || records[i].ptr == ptr))
       {
         records[i].ptr =
             (i == 0) ? (char *)hdr.leftmost_ptr : records[i - 1].ptr;
@@ -197,11 +324,11 @@ public:
   bool remove(btree *bt, entry_key_t key, bool only_rebalance = false,
               bool with_lock = true)
   {
-    hdr.splk->lock();                                                
+    hdr.latch.lock();                                                
 
     bool ret = remove_key(key);
 
-    hdr.splk->unlock();
+    hdr.latch.unlock();
 
     return ret;
   }
@@ -211,13 +338,13 @@ public:
   {
     if (with_lock)
     {
-      hdr.splk->lock();                                               
+      hdr.latch.lock();                                               
     }
     if (hdr.is_deleted)
     {
       if (with_lock)
       {
-        hdr.splk->unlock();
+        hdr.latch.unlock();
       }
       return false;
     }
@@ -243,7 +370,7 @@ public:
 
         if (with_lock)
         {
-          hdr.splk->unlock();
+          hdr.latch.unlock();
         }
         return true;
       }
@@ -260,7 +387,7 @@ public:
       {
         if (with_lock)
         {
-          hdr.splk->unlock();
+          hdr.latch.unlock();
         }
         return (hdr.leftmost_ptr == nullptr) ? ret : true;
       }
@@ -278,25 +405,25 @@ public:
     {
       if (with_lock)
       {
-        hdr.splk->unlock();
+        hdr.latch.unlock();
       }
 
       if (!with_lock)
       {
-        hdr.sibling_ptr->hdr.splk->lock();
+        hdr.sibling_ptr->hdr.latch.lock();
       }
       hdr.sibling_ptr->remove(bt, hdr.sibling_ptr->records[0].key, true,
                               with_lock);
       if (!with_lock)
       {
-        hdr.sibling_ptr->hdr.splk->unlock();
+        hdr.sibling_ptr->hdr.latch.unlock();
       }
       return true;
     }
 
     if (with_lock)
     {
-      left_sibling->hdr.splk->lock();
+      left_sibling->hdr.latch.lock();
     }
 
     while (left_sibling->hdr.sibling_ptr != this)
@@ -304,9 +431,9 @@ public:
       if (with_lock)
       {
         page *t = left_sibling->hdr.sibling_ptr;
-        left_sibling->hdr.splk->unlock();
+        left_sibling->hdr.latch.unlock();
         left_sibling = t;
-        left_sibling->hdr.splk->lock();
+        left_sibling->hdr.latch.lock();
       }
       else
         left_sibling = left_sibling->hdr.sibling_ptr;
@@ -378,9 +505,9 @@ public:
         hdr.is_deleted = 1;
 
         page *new_sibling = new page(hdr.level);
-        new_sibling->hdr.splk->unlock();
-        new_sibling->hdr.splk->lock();// acquire lock
+        new_sibling->hdr.latch.lock(); // acquire lock
         new_sibling->hdr.sibling_ptr = hdr.sibling_ptr;
+        new_sibling->hdr.prev_ptr = left_sibling;
 
         int num_dist_entries = num_entries - m;
         int new_sibling_cnt = 0;
@@ -426,6 +553,8 @@ public:
 
           left_sibling->hdr.sibling_ptr = new_sibling;
         }
+        if (new_sibling->hdr.sibling_ptr)
+          new_sibling->hdr.sibling_ptr->hdr.prev_ptr = new_sibling;
 
         if (left_sibling == ((page *)bt->root))
         {
@@ -439,7 +568,7 @@ public:
                                     (char *)new_sibling, hdr.level + 1);
         }
 
-        new_sibling->hdr.splk->unlock();
+        new_sibling->hdr.latch.unlock();
       }
     }
     else
@@ -456,12 +585,14 @@ public:
       }
 
       left_sibling->hdr.sibling_ptr = hdr.sibling_ptr;
+      if (hdr.sibling_ptr)
+        hdr.sibling_ptr->hdr.prev_ptr = left_sibling;
     }
 
     if (with_lock)
     {
-      left_sibling->hdr.splk->unlock();
-      hdr.splk->unlock();
+      left_sibling->hdr.latch.unlock();
+      hdr.latch.unlock();
     }
 
     return true;
@@ -476,12 +607,10 @@ public:
 
     if (*num_entries == 0)
     { // this page is empty
-      entry *new_entry = (entry *)&records[0];
-      entry *array_end = (entry *)&records[1];
-      new_entry->key = (entry_key_t)key;
-      new_entry->ptr = (char *)ptr;
+      records[0].key = (entry_key_t)key;
+      records[0].ptr = (char *)ptr;
 
-      array_end->ptr = (char *)nullptr;
+      records[1].ptr = (char *)nullptr;
     }
     else
     {
@@ -519,19 +648,64 @@ public:
     ++(*num_entries);
   }
 
+  // Inserts the longest prefix of the sorted keys that belongs to this leaf
+  // and fits in it under one lock acquisition. fence is the separator that
+  // bounds the leaf in its parent. Returns how many keys were inserted, 0
+  // when the first key needs a split or belongs to a sibling.
+  size_t store_batch(const entry_key_t *keys, char *const *ptrs, size_t num,
+                     entry_key_t fence)
+  {
+    hdr.latch.lock();
+    if (hdr.is_deleted)
+    {
+      hdr.latch.unlock();
+      return 0;
+    }
+
+    // store() hands the keys greater than this bound to the sibling
+    page *sibling = hdr.sibling_ptr;
+    entry_key_t bound = sibling ? sibling->records[0].key : LONG_MAX;
+
+    int num_entries = count();
+    size_t i = 0;
+    while (i < num && num_entries < cardinality - 1 && keys[i] < fence &&
+           (!sibling || keys[i] <= bound))
+    {
+      insert_key(keys[i], ptrs[i], &num_entries);
+      ++i;
+    }
+
+    hdr.latch.unlock();
+    return i;
+  }
+
+  // The smallest separator of this internal page above key, LONG_MAX if
+  // there is none. The first key of a leaf can be above the separator of the
+  // leaf once a delete removed it, so the keys between them would be routed
+  // to that leaf by the parent but stored in the leaf left of it by store().
+  entry_key_t upper_fence(entry_key_t key)
+  {
+    for (int i = 0; records[i].ptr != nullptr; ++i)
+    {
+      if (records[i].key > key)
+        return records[i].key;
+    }
+    return LONG_MAX;
+  }
+
   // Insert a new key
   page *store(btree *bt, char *left, entry_key_t key, char *right,
               bool with_lock, page *invalid_sibling = nullptr)
   {
     if (with_lock)
     {
-      hdr.splk->lock();
+      hdr.latch.lock();
     }
     if (hdr.is_deleted)
     {
       if (with_lock)
       {
-        hdr.splk->unlock();
+        hdr.latch.unlock();
       }
 
       return nullptr;
@@ -545,7 +719,7 @@ public:
       {
         if (with_lock)
         {
-          hdr.splk->unlock();
+          hdr.latch.unlock();
         }
         return hdr.sibling_ptr->store(bt, nullptr, key, right, with_lock,
                                       invalid_sibling);
@@ -560,7 +734,7 @@ public:
 
       if (with_lock)
       {
-        hdr.splk->unlock(); 
+        hdr.latch.unlock(); 
       }
 
       return this;
@@ -591,10 +765,17 @@ public:
         }
         sibling->hdr.leftmost_ptr = (page *)records[m].ptr;
       }
+      // the sibling is not reachable yet, so count() can start from here
+      sibling->hdr.last_index = sibling_cnt - 1;
 
       sibling->hdr.sibling_ptr = hdr.sibling_ptr;
+      sibling->hdr.prev_ptr = this;
 
       hdr.sibling_ptr = sibling;
+      // the right page is found from the left one first, so a descending
+      // scan that still reads the old prev_ptr walks right to the sibling
+      if (sibling->hdr.sibling_ptr)
+        sibling->hdr.sibling_ptr->hdr.prev_ptr = sibling;
 
       if (hdr.switch_counter % 2 == 0)
         hdr.switch_counter += 2;
@@ -629,14 +810,14 @@ public:
 
         if (with_lock)
         {
-          hdr.splk->unlock(); 
+          hdr.latch.unlock(); 
         }
       }
       else
       {
         if (with_lock)
         {
-          hdr.splk->unlock();
+          hdr.latch.unlock();
         }
         bt->btree_insert_internal(nullptr, split_key, (char *)sibling,
                                   hdr.level + 1);
@@ -646,111 +827,140 @@ public:
     }
   }
 
-  // range search
-  void linear_search_range(entry_key_t min, entry_key_t max,
-                           unsigned long *buf, int &off)
+  // Passes the slots of this page whose keys are within the bounds to
+  // emit(key, ptr), min and max themselves only if they are inclusive.
+  // Returns false once a key above max is seen.
+  template <typename Emit>
+  bool scan_range(entry_key_t min, entry_key_t max, bool min_inclusive,
+                  bool max_inclusive, Emit emit, uint8_t switch_counter)
   {
     int i;
-    uint8_t previous_switch_counter;
-    page *current = this;
-
-    while (current)
+    entry_key_t tmp_key;
+    char *tmp_ptr;
+    auto above_min = [&](entry_key_t k)
+    { return k > min || (min_inclusive && k == min); };
+    auto below_max = [&](entry_key_t k)
+    { return k < max || (max_inclusive && k == max); };
+
+    if (switch_counter % 2 == 0)
     {
-      int old_off = off;
-      do
-      {
-        previous_switch_counter = current->hdr.switch_counter;
-        off = old_off;
-
-        entry_key_t tmp_key;
-        char *tmp_ptr;
+      int start = 1;
+#ifdef RANK_SEARCH
+      // skip the keys below the bound
+      start = std::max(1, rank(min, count(), !min_inclusive));
+#endif
 
-        if (previous_switch_counter % 2 == 0)
+      if (above_min(tmp_key = records[0].key))
+      {
+        if (below_max(tmp_key))
         {
-          if ((tmp_key = current->records[0].key) > min)
+          if ((tmp_ptr = records[0].ptr) != nullptr)
           {
-            if (tmp_key < max)
+            if (tmp_key == records[0].key)
             {
-              if ((tmp_ptr = current->records[0].ptr) != nullptr)
+              if (tmp_ptr)
               {
-                if (tmp_key == current->records[0].key)
-                {
-                  if (tmp_ptr)
-                  {
-                    buf[off++] = (unsigned long)tmp_ptr;
-                  }
-                }
+                emit(tmp_key, tmp_ptr);
               }
             }
-            else
-              return;
           }
+        }
+        else
+          return false;
+      }
 
-          for (i = 1; current->records[i].ptr != nullptr; ++i)
+      for (i = start; records[i].ptr != nullptr; ++i)
+      {
+        if (above_min(tmp_key = records[i].key))
+        {
+          if (below_max(tmp_key))
           {
-            if ((tmp_key = current->records[i].key) > min)
+            if ((tmp_ptr = records[i].ptr) != records[i - 1].ptr)
             {
-              if (tmp_key < max)
+              if (tmp_key == records[i].key)
               {
-                if ((tmp_ptr = current->records[i].ptr) !=
-                    current->records[i - 1].ptr)
-                {
-                  if (tmp_key == current->records[i].key)
-                  {
-                    if (tmp_ptr)
-                      buf[off++] = (unsigned long)tmp_ptr;
-                  }
-                }
+                if (tmp_ptr)
+                  emit(tmp_key, tmp_ptr);
               }
-              else
-                return;
             }
           }
+          else
+            return false;
         }
-        else
+      }
+    }
+    else
+    {
+      // the keys come from the right, one above max does not end the page
+      bool more = true;
+      for (i = count() - 1; i > 0; --i)
+      {
+        if (above_min(tmp_key = records[i].key))
         {
-          for (i = count() - 1; i > 0; --i)
+          if (below_max(tmp_key))
           {
-            if ((tmp_key = current->records[i].key) > min)
+            if ((tmp_ptr = records[i].ptr) != records[i - 1].ptr)
             {
-              if (tmp_key < max)
+              if (tmp_key == records[i].key)
               {
-                if ((tmp_ptr = current->records[i].ptr) !=
-                    current->records[i - 1].ptr)
-                {
-                  if (tmp_key == current->records[i].key)
-                  {
-                    if (tmp_ptr)
-                      buf[off++] = (unsigned long)tmp_ptr;
-                  }
-                }
+                if (tmp_ptr)
+                  emit(tmp_key, tmp_ptr);
               }
-              else
-                return;
             }
           }
+          else
+            more = false;
+        }
+      }
 
-          if ((tmp_key = current->records[0].key) > min)
+      if (above_min(tmp_key = records[0].key))
+      {
+        if (below_max(tmp_key))
+        {
+          if ((tmp_ptr = records[0].ptr) != nullptr)
           {
-            if (tmp_key < max)
+            if (tmp_key == records[0].key)
             {
-              if ((tmp_ptr = current->records[0].ptr) != nullptr)
+              if (tmp_ptr)
               {
-                if (tmp_key == current->records[0].key)
-                {
-                  if (tmp_ptr)
-                  {
-                    buf[off++] = (unsigned long)tmp_ptr;
-                  }
-                }
+                emit(tmp_key, tmp_ptr);
               }
             }
-            else
-              return;
           }
         }
-      } while (previous_switch_counter != current->hdr.switch_counter);
+        else
+          return false;
+      }
+      return more;
+    }
+    return true;
+  }
+
+  void linear_search_range(entry_key_t min, entry_key_t max,
+                           unsigned long *buf, int &off)
+  {
+    uint8_t previous_switch_counter;
+    uint64_t version;
+    page *current = this;
 
+    while (current)
+    {
+      int old_off = off;
+      bool more;
+      do
+      {
+        version = current->hdr.latch.read_lock();
+        previous_switch_counter = current->hdr.switch_counter;
+        off = old_off;
+        more = current->scan_range(
+            min, max, false, false,
+            [&](entry_key_t, char *ptr) { buf[off++] = (unsigned long)ptr; },
+            previous_switch_counter);
+      } while (!current->hdr.latch.validate(version) ||
+               previous_switch_counter != current->hdr.switch_counter);
+
+      if (!more)
+        return;
       current = current->hdr.sibling_ptr;
     }
   }
@@ -759,6 +969,7 @@ public:
   {
     int i = 1;
     uint8_t previous_switch_counter;
+    uint64_t version;
     char *ret = nullptr;
     char *t;
     entry_key_t k;
@@ -767,12 +978,30 @@ public:
     { // Search a leaf node
       do
       {
+        version = hdr.latch.read_lock();
         previous_switch_counter = hdr.switch_counter;
         ret = nullptr;
 
         // search from left ro right
         if (previous_switch_counter % 2 == 0)
         {
+#ifdef RANK_SEARCH
+          int num_entries = count();
+          i = rank(key, num_entries, false);
+          if (i == num_entries || (k = records[i].key) != key)
+            continue; // not in this page
+
+          t = records[i].ptr;
+          if (t != nullptr && t != ((i == 0) ? nullptr : records[i - 1].ptr))
+          {
+            if (k == records[i].key)
+            {
+              ret = t;
+              continue;
+            }
+          }
+          // the slot is being shifted, fall back to the scan
+#endif
           if ((k = records[0].key) == key)
           {
             if ((t = records[0].ptr) != nullptr)
@@ -832,7 +1061,8 @@ public:
             }
           }
         }
-      } while (hdr.switch_counter != previous_switch_counter);
+      } while (!hdr.latch.validate(version) ||
+               hdr.switch_counter != previous_switch_counter);
 
       if (ret)
       {
@@ -848,11 +1078,23 @@ public:
     { // internal node
       do
       {
+        version = hdr.latch.read_lock();
         previous_switch_counter = hdr.switch_counter;
         ret = nullptr;
 
         if (previous_switch_counter % 2 == 0)
         {
+#ifdef RANK_SEARCH
+          int num_entries = count();
+          i = rank(key, num_entries, true);
+          t = (i == 0) ? (char *)hdr.leftmost_ptr : records[i - 1].ptr;
+          if (i == num_entries || t != records[i].ptr)
+          {
+            ret = t;
+            continue;
+          }
+          // the slot is being shifted, fall back to the scan
+#endif
           if (key < (k = records[0].key))
           {
             if ((t = (char *)hdr.leftmost_ptr) != records[0].ptr)
@@ -905,7 +1147,8 @@ public:
             }
           }
         }
-      } while (hdr.switch_counter != previous_switch_counter);
+      } while (!hdr.latch.validate(version) ||
+               hdr.switch_counter != previous_switch_counter);
 
       if ((t = (char *)hdr.sibling_ptr) != nullptr)
       {
@@ -928,19 +1171,22 @@ public:
 /*
  * class btree
  */
-btree::btree()
+template <typename Lock>
+basic_btree<Lock>::basic_btree()
 {
   root = (char *)new page();
   height = 1;
 }
 
-void btree::setNewRoot(char *new_root)
+template <typename Lock>
+void basic_btree<Lock>::setNewRoot(char *new_root)
 {
   this->root = (char *)new_root;
   ++height;
 }
 
-char *btree::btree_search(entry_key_t key)
+template <typename Lock>
+char *basic_btree<Lock>::btree_search(entry_key_t key)
 {
   page *p = (page *)root;
 
@@ -968,7 +1214,57 @@ char *btree::btree_search(entry_key_t key)
   return (char *)t;
 }
 
-void btree::btree_insert(entry_key_t key, char *right)
+// Looks up keys[0..num) and stores the value of every key to results, or
+// nullptr if it is not in the tree. Groups of SEARCH_BATCH_GROUP keys descend
+// level by level: the child page of a key is prefetched when it is found and
+// only searched after the rest of the group, so the misses of the group
+// overlap instead of stalling every search once per level.
+template <typename Lock>
+void basic_btree<Lock>::btree_search_batch(const entry_key_t *keys,
+                                           size_t num, char **results)
+{
+  page *cur[SEARCH_BATCH_GROUP];
+  for (size_t base = 0; base < num; base += SEARCH_BATCH_GROUP)
+  {
+    int n = (int)std::min(num - base, (size_t)SEARCH_BATCH_GROUP);
+    const entry_key_t *k = keys + base;
+    for (int j = 0; j < n; j++)
+      cur[j] = (page *)root;
+
+    // one round per level, a key that moved to a sibling stays on its level
+    bool descending = true;
+    while (descending)
+    {
+      descending = false;
+      for (int j = 0; j < n; j++)
+      {
+        if (cur[j]->hdr.leftmost_ptr == nullptr)
+          continue;
+        cur[j] = (page *)cur[j]->linear_search(k[j]);
+        prefetch_page(cur[j]);
+        descending = true;
+      }
+    }
+
+    for (int j = 0; j < n; j++)
+    {
+      page *p = cur[j];
+      page *t;
+      while ((t = (page *)p->linear_search(k[j])) == p->hdr.sibling_ptr)
+      {
+        p = t;
+        if (!p)
+        {
+          break;
+        }
+      }
+      results[base + j] = (char *)t;
+    }
+  }
+}
+
+template <typename Lock>
+void basic_btree<Lock>::btree_insert(entry_key_t key, char *right)
 {
   page *p = (page *)root;
 
@@ -983,8 +1279,9 @@ void btree::btree_insert(entry_key_t key, char *right)
   }
 }
 
-void btree::btree_insert_internal(char *left, entry_key_t key, char *right,
-                                  uint32_t level)
+template <typename Lock>
+void basic_btree<Lock>::btree_insert_internal(char *left, entry_key_t key,
+                                              char *right, uint32_t level)
 {
   if (level > ((page *)root)->hdr.level)
     return;
@@ -1000,7 +1297,8 @@ void btree::btree_insert_internal(char *left, entry_key_t key, char *right,
   }
 }
 
-void btree::btree_delete(entry_key_t key)
+template <typename Lock>
+void basic_btree<Lock>::btree_delete(entry_key_t key)
 {
   page *p = (page *)root;
 
@@ -1030,9 +1328,41 @@ void btree::btree_delete(entry_key_t key)
   }
 }
 
-void btree::btree_delete_internal(entry_key_t key, char *ptr, uint32_t level,
-                                  entry_key_t *deleted_key,
-                                  bool *is_leftmost_node, page **left_sibling)
+// Removes the entry (key, ptr) and returns whether it was there. Among
+// equal keys it removes the one with ptr, and a missing entry is no error.
+template <typename Lock>
+bool basic_btree<Lock>::btree_delete(entry_key_t key, char *ptr)
+{
+  // equal keys can be on both sides of a split, as in btree_scan_where
+  entry_key_t descend = key > LLONG_MIN ? key - 1 : key;
+  page *p = (page *)root;
+  while (p->hdr.leftmost_ptr != nullptr)
+  {
+    p = (page *)p->linear_search(descend);
+  }
+
+  while (p)
+  {
+    p->hdr.latch.lock();
+    bool removed = p->remove_key(key, ptr);
+    bool past = false; // the leaf holds a key above key
+    for (int i = 0; !past && p->records[i].ptr != nullptr; i++)
+      past = p->records[i].key > key;
+    page *next = p->hdr.sibling_ptr;
+    p->hdr.latch.unlock();
+    if (removed || past)
+      return removed;
+    p = next;
+  }
+  return false;
+}
+
+template <typename Lock>
+void basic_btree<Lock>::btree_delete_internal(entry_key_t key, char *ptr,
+                                              uint32_t level,
+                                              entry_key_t *deleted_key,
+                                              bool *is_leftmost_node,
+                                              page **left_sibling)
 {
   if (level > ((page *)this->root)->hdr.level)
     return;
@@ -1044,12 +1374,12 @@ void btree::btree_delete_internal(entry_key_t key, char *ptr, uint32_t level,
     p = (page *)p->linear_search(key);
   }
 
-  p->hdr.splk->lock();
+  p->hdr.latch.lock();
 
   if ((char *)p->hdr.leftmost_ptr == ptr)
   {
     *is_leftmost_node = true;
-    p->hdr.splk->unlock();
+    p->hdr.latch.unlock();
     return;
   }
 
@@ -1082,12 +1412,13 @@ void btree::btree_delete_internal(entry_key_t key, char *ptr, uint32_t level,
     }
   }
 
-  p->hdr.splk->unlock();
+  p->hdr.latch.unlock();
 }
 
 // range > min && range < max 
-void btree::btree_search_range(entry_key_t min, entry_key_t max,
-                               unsigned long *buf, int &offset)
+template <typename Lock>
+void basic_btree<Lock>::btree_search_range(entry_key_t min, entry_key_t max,
+                                           unsigned long *buf, int &offset)
 {
   page *p = (page *)root;
 
@@ -1107,3 +1438,353 @@ void btree::btree_search_range(entry_key_t min, entry_key_t max,
     }
   }
 }
+
+// Calls visit(key, ptr) for the entries with min < key < max, in key order,
+// until visit returns false. min_inclusive and max_inclusive also take in
+// the entries equal to the bounds. Every leaf is first copied to a snapshot
+// on the stack and only handed out once the copy is validated, so the scan
+// runs in constant memory and visit never sees a leaf in the middle of an
+// update. The validation is exact with the locks that readers check
+// (rw_spinlock, version_lock); the spin locks leave it to switch_counter.
+template <typename Lock>
+template <typename Visitor>
+void basic_btree<Lock>::btree_scan(entry_key_t min, entry_key_t max,
+                                   bool min_inclusive, bool max_inclusive,
+                                   Visitor visit)
+{
+  btree_scan_where(min, max, min_inclusive, max_inclusive, accept_all(),
+                   visit);
+}
+
+// btree_scan that only passes the entries for which where(key, ptr) holds.
+// The predicate runs on the validated snapshot of a leaf, so it never
+// follows a pointer read from a leaf in the middle of an update.
+template <typename Lock>
+template <typename Predicate, typename Visitor>
+void basic_btree<Lock>::btree_scan_where(entry_key_t min, entry_key_t max,
+                                         bool min_inclusive,
+                                         bool max_inclusive, Predicate where,
+                                         Visitor visit)
+{
+  // equal keys can be on both sides of a split, so an inclusive scan starts
+  // from the leaf of the keys below min
+  entry_key_t descend = (min_inclusive && min > LLONG_MIN) ? min - 1 : min;
+  page *p = (page *)root;
+  while (p->hdr.leftmost_ptr != nullptr)
+  {
+    p = (page *)p->linear_search(descend);
+  }
+
+  entry_key_t keys[cardinality];
+  char *ptrs[cardinality];
+  // a leaf that splits while it is copied can pass its upper half to the
+  // snapshot of the sibling again, those entries are not past the last one
+  entry_key_t last_key = LLONG_MIN;
+  char *last_ptr = nullptr;
+  while (p)
+  {
+    uint8_t previous_switch_counter;
+    uint64_t version;
+    page *next;
+    int n;
+    bool more;
+    do
+    {
+      version = p->hdr.latch.read_lock();
+      previous_switch_counter = p->hdr.switch_counter;
+      n = 0;
+      more = p->scan_range(
+          min, max, min_inclusive, max_inclusive,
+          [&](entry_key_t k, char *ptr)
+          {
+            keys[n] = k;
+            ptrs[n++] = ptr;
+          },
+          previous_switch_counter);
+      next = p->hdr.sibling_ptr;
+    } while (!p->hdr.latch.validate(version) ||
+             previous_switch_counter != p->hdr.switch_counter);
+
+    // a page scanned from the right gave its keys in descending order
+    bool descending = previous_switch_counter % 2 != 0;
+    for (int i = 0; i < n; i++)
+    {
+      int j = descending ? n - 1 - i : i;
+      if (last_ptr != nullptr && (keys[j] < last_key ||
+                                  (keys[j] == last_key && ptrs[j] == last_ptr)))
+        continue;
+      last_key = keys[j];
+      last_ptr = ptrs[j];
+      if (where(keys[j], ptrs[j]) && !visit(keys[j], ptrs[j]))
+        return;
+    }
+
+    if (!more)
+      return;
+    p = next;
+  }
+}
+
+// Calls visit(key, ptr) for the entries between the bounds like btree_scan,
+// but in descending key order. The scan starts from the leaf of max and
+// moves left along prev_ptr. prev_ptr is a hint: when the leaf it points to
+// has split since, its sibling is no longer the leaf scanned last, and the
+// scan walks right from it until it is.
+template <typename Lock>
+template <typename Visitor>
+void basic_btree<Lock>::btree_scan_reverse(entry_key_t min, entry_key_t max,
+                                           bool min_inclusive,
+                                           bool max_inclusive, Visitor visit)
+{
+  page *p = (page *)root;
+  while (p->hdr.leftmost_ptr != nullptr)
+  {
+    p = (page *)p->linear_search(max);
+  }
+  // equal keys can be on both sides of a split, start from the last leaf
+  page *t;
+  while ((t = p->hdr.sibling_ptr) != nullptr &&
+         (t->records[0].key < max ||
+          (max_inclusive && t->records[0].key == max)))
+  {
+    p = t;
+  }
+
+  entry_key_t keys[cardinality];
+  char *ptrs[cardinality];
+  entry_key_t last_key = LLONG_MAX;
+  char *last_ptr = nullptr;
+  page *right = nullptr; // the leaf scanned last
+  while (p)
+  {
+    uint8_t previous_switch_counter;
+    uint64_t version;
+    page *next;
+    page *prev;
+    bool more;
+    int n;
+    do
+    {
+      version = p->hdr.latch.read_lock();
+      previous_switch_counter = p->hdr.switch_counter;
+      n = 0;
+      p->scan_range(
+          min, max, min_inclusive, max_inclusive,
+          [&](entry_key_t k, char *ptr)
+          {
+            keys[n] = k;
+            ptrs[n++] = ptr;
+          },
+          previous_switch_counter);
+      next = p->hdr.sibling_ptr;
+      prev = p->hdr.prev_ptr;
+      // the keys left of this page are below its first key
+      more = p->records[0].ptr == nullptr || p->records[0].key > min ||
+             (min_inclusive && p->records[0].key == min);
+    } while (!p->hdr.latch.validate(version) ||
+             previous_switch_counter != p->hdr.switch_counter);
+
+    if (right != nullptr && next != right)
+    {
+      p = next;
+      continue;
+    }
+
+    // a page scanned from the left gave its keys in ascending order
+    bool ascending = previous_switch_counter % 2 == 0;
+    for (int i = 0; i < n; i++)
+    {
+      int j = ascending ? n - 1 - i : i;
+      if (last_ptr != nullptr && (keys[j] > last_key ||
+                                  (keys[j] == last_key && ptrs[j] == last_ptr)))
+        continue;
+      last_key = keys[j];
+      last_ptr = ptrs[j];
+      if (!visit(keys[j], ptrs[j]))
+        return;
+    }
+
+    if (!more)
+      return;
+    right = p;
+    p = prev;
+  }
+}
+
+// Sorts the (key, ptr) pairs into sorted_keys and sorted_ptrs. The position
+// breaks ties, so equal keys keep their input order like with btree_insert.
+static void sort_pairs(const entry_key_t *keys, char *const *ptrs, size_t num,
+                       vector<entry_key_t> &sorted_keys,
+                       vector<char *> &sorted_ptrs)
+{
+  vector<pair<entry_key_t, size_t>> order(num);
+  for (size_t i = 0; i < num; i++)
+    order[i] = make_pair(keys[i], i);
+  std::sort(order.begin(), order.end());
+
+  sorted_keys.resize(num);
+  sorted_ptrs.resize(num);
+  for (size_t i = 0; i < num; i++)
+  {
+    sorted_keys[i] = order[i].first;
+    sorted_ptrs[i] = ptrs[order[i].second];
+  }
+}
+
+// number of entries of a bulk loaded page, between 1 and cardinality - 1
+static inline int bulk_fill(double fill_factor)
+{
+  int num_entries = (int)((cardinality - 1) * fill_factor);
+  return std::min(std::max(num_entries, 1), cardinality - 1);
+}
+
+// a leaf holding the sorted entries [begin, end)
+template <typename Lock>
+typename basic_btree<Lock>::page *
+basic_btree<Lock>::bulk_leaf(const entry_key_t *keys, char *const *ptrs,
+                             size_t begin, size_t end)
+{
+  page *leaf = new page(0);
+  int num_entries = 0;
+  for (size_t i = begin; i < end; i++)
+    leaf->insert_key(keys[i], ptrs[i], &num_entries);
+  return leaf;
+}
+
+// Builds the internal levels on top of the linked pages of one level, whose
+// smallest keys are in low_keys, and makes the top page the root.
+template <typename Lock>
+void basic_btree<Lock>::bulk_build_levels(vector<page *> &pages,
+                                          vector<entry_key_t> &low_keys,
+                                          double fill_factor)
+{
+  uint32_t level = 0;
+  size_t fanout = std::max(bulk_fill(fill_factor) + 1, 3);
+
+  while (pages.size() > 1)
+  {
+    ++level;
+    size_t num_parents = (pages.size() + fanout - 1) / fanout;
+    vector<page *> parents(num_parents);
+    vector<entry_key_t> parent_keys(num_parents);
+
+    for (size_t i = 0; i < num_parents; i++)
+    {
+      // spread the children evenly, so every parent gets at least two
+      size_t begin = pages.size() * i / num_parents;
+      size_t end = pages.size() * (i + 1) / num_parents;
+
+      page *parent = new page(level);
+      parent->hdr.leftmost_ptr = pages[begin];
+      int num_entries = 0;
+      for (size_t c = begin + 1; c < end; c++)
+        parent->insert_key(low_keys[c], (char *)pages[c], &num_entries);
+
+      if (i > 0)
+      {
+        parents[i - 1]->hdr.sibling_ptr = parent;
+        parent->hdr.prev_ptr = parents[i - 1];
+      }
+      parents[i] = parent;
+      parent_keys[i] = low_keys[begin];
+    }
+
+    pages.swap(parents);
+    low_keys.swap(parent_keys);
+  }
+
+  delete (page *)root;
+  root = (char *)pages[0];
+  height = level + 1;
+}
+
+// Builds the tree bottom-up from (key, ptr) pairs: the leaves are packed
+// to fill_factor of their capacity and linked, then the internal levels
+// are built over them. The pairs are sorted first unless the keys already
+// are. A tree that is not empty gets the pairs through btree_insert.
+template <typename Lock>
+void basic_btree<Lock>::btree_bulk_load(const entry_key_t *keys, char *const *ptrs,
+                                        size_t num, double fill_factor)
+{
+  page *p = (page *)root;
+
+  if (p->hdr.leftmost_ptr != nullptr || p->count() > 0)
+  {
+    for (size_t i = 0; i < num; i++)
+      btree_insert(keys[i], ptrs[i]);
+    return;
+  }
+
+  if (num == 0)
+    return;
+
+  vector<entry_key_t> sorted_keys;
+  vector<char *> sorted_ptrs;
+  if (!std::is_sorted(keys, keys + num))
+  {
+    sort_pairs(keys, ptrs, num, sorted_keys, sorted_ptrs);
+    keys = sorted_keys.data();
+    ptrs = sorted_ptrs.data();
+  }
+
+  size_t per_leaf = bulk_fill(fill_factor);
+  size_t num_leaves = (num + per_leaf - 1) / per_leaf;
+  vector<page *> leaves(num_leaves);
+  vector<entry_key_t> low_keys(num_leaves);
+
+  for (size_t i = 0; i < num_leaves; i++)
+  {
+    size_t begin = num * i / num_leaves;
+    leaves[i] = bulk_leaf(keys, ptrs, begin, num * (i + 1) / num_leaves);
+    low_keys[i] = keys[begin];
+    if (i > 0)
+    {
+      leaves[i - 1]->hdr.sibling_ptr = leaves[i];
+      leaves[i]->hdr.prev_ptr = leaves[i - 1];
+    }
+  }
+
+  bulk_build_levels(leaves, low_keys, fill_factor);
+}
+
+// Inserts a batch of (key, ptr) pairs. The batch is sorted, and every run of
+// keys that lands in the same leaf is inserted with one traversal and one
+// lock acquisition. A key that needs a split goes through store().
+template <typename Lock>
+void basic_btree<Lock>::btree_insert_batch(const entry_key_t *keys,
+                                           char *const *ptrs, size_t num)
+{
+  vector<entry_key_t> sorted_keys;
+  vector<char *> sorted_ptrs;
+  if (!std::is_sorted(keys, keys + num))
+  {
+    sort_pairs(keys, ptrs, num, sorted_keys, sorted_ptrs);
+    keys = sorted_keys.data();
+    ptrs = sorted_ptrs.data();
+  }
+
+  size_t i = 0;
+  while (i < num)
+  {
+    page *p = (page *)root;
+    entry_key_t fence = LONG_MAX;
+    while (p->hdr.leftmost_ptr != nullptr)
+    {
+      fence = std::min(fence, p->upper_fence(keys[i]));
+      p = (page *)p->linear_search(keys[i]);
+    }
+
+    size_t inserted = p->store_batch(keys + i, ptrs + i, num - i, fence);
+    if (inserted == 0)
+    {
+      if (!p->store(this, nullptr, keys[i], ptrs[i], true))
+        btree_insert(keys[i], ptrs[i]);
+      inserted = 1;
+    }
+    i += inserted;
+  }
+}
+
+typedef basic_btree<page_lock> btree;
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include "btree.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+/*
+ * Snapshot file of a checkpoint: a 64 byte header, then the (key, value)
+ * entries of the tree in key order, 16 bytes each. The header holds the LSN
+ * the log is replayed from and is written last, the file is written under a
+ * temporary name and renamed over the old snapshot once it is on disk, so a
+ * crash leaves either snapshot complete.
+ */
+
+#define SNAPSHOT_MAGIC "DBESNAPS"
+#define SNAPSHOT_VERSION 1
+// entries written or read per system call
+#define SNAPSHOT_CHUNK 65536
+
+struct snapshot_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint64_t lsn;   // the records up to it are in the snapshot
+  uint64_t count; // entries
+  uint64_t checksum;
+  char reserved[24];
+};
+
+struct snapshot_entry
+{
+  entry_key_t key;
+  uint64_t value;
+};
+
+static_assert(sizeof(snapshot_header) == 64, "snapshot_header is not 64 bytes");
+
+static inline uint64_t snapshot_checksum(uint64_t h, const snapshot_entry &e)
+{
+  h = (h ^ (uint64_t)e.key) * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ e.value) * 0xbf58476d1ce4e5b9ULL;
+  return h ^ (h >> 31);
+}
+
+// makes the directory entry of path durable after a create or rename
+static inline bool sync_directory(const char *path)
+{
+  std::string copy(path);
+  int dir = ::open(dirname(&copy[0]), O_RDONLY);
+  if (dir < 0)
+    return false;
+  bool ok = fsync(dir) == 0;
+  ::close(dir);
+  return ok;
+}
+
+class snapshot_writer
+{
+private:
+  std::string path, temp;
+  int fd;
+  std::vector<snapshot_entry> chunk;
+  uint64_t count, checksum;
+  bool failed;
+
+  void write_chunk()
+  {
+    size_t bytes = chunk.size() * sizeof(snapshot_entry);
+    off_t at = sizeof(snapshot_header) + (count - chunk.size()) * sizeof(snapshot_entry);
+    failed = failed || pwrite(fd, chunk.data(), bytes, at) != (ssize_t)bytes;
+    chunk.clear();
+  }
+
+public:
+  snapshot_writer() : fd(-1), count(0), checksum(0), failed(false) {}
+  ~snapshot_writer()
+  {
+    if (fd >= 0)
+    {
+      ::close(fd);
+      unlink(temp.c_str());
+    }
+  }
+
+  bool open(const char *file, std::string &error)
+  {
+    path = file;
+    temp = path + ".tmp";
+    fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+      error = "cannot open " + temp + ": " + strerror(errno);
+      return false;
+    }
+    chunk.reserve(SNAPSHOT_CHUNK);
+    return true;
+  }
+
+  // the entries are added in key order
+  void add(entry_key_t key, uint64_t value)
+  {
+    snapshot_entry e{key, value};
+    chunk.push_back(e);
+    checksum = snapshot_checksum(checksum, e);
+    if (++count % SNAPSHOT_CHUNK == 0)
+      write_chunk();
+  }
+
+  // Writes the header with lsn, syncs the file and renames it over the
+  // snapshot.
+  bool finish(uint64_t lsn, std::string &error)
+  {
+    write_chunk();
+    snapshot_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.entry_size = sizeof(snapshot_entry);
+    hdr.lsn = lsn;
+    hdr.count = count;
+    hdr.checksum = checksum;
+    bool ok = !failed && pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+              fdatasync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    fd = -1;
+    ok = ok && rename(temp.c_str(), path.c_str()) == 0 &&
+         sync_directory(path.c_str());
+    if (!ok)
+    {
+      error = "cannot write " + path + ": " + strerror(errno);
+      unlink(temp.c_str());
+    }
+    return ok;
+  }
+
+  uint64_t size() const { return count; }
+};
+
+// Reads the snapshot at path into keys and values. A missing file is an
+// empty snapshot with LSN 0, a truncated or corrupt one is an error.
+static inline bool read_snapshot(const char *path, vector<entry_key_t> &keys,
+                                 vector<char *> &values, uint64_t *lsn,
+                                 std::string &error)
+{
+  keys.clear();
+  values.clear();
+  *lsn = 0;
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    if (errno == ENOENT)
+      return true;
+    error = std::string("cannot open ") + path + ": " + strerror(errno);
+    return false;
+  }
+
+  snapshot_header hdr;
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0 &&
+            pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+            memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) == 0 &&
+            hdr.version == SNAPSHOT_VERSION &&
+            hdr.entry_size == sizeof(snapshot_entry) &&
+            hdr.count == (st.st_size - sizeof(hdr)) / sizeof(snapshot_entry);
+  if (ok)
+  {
+    keys.resize(hdr.count);
+    values.resize(hdr.count);
+    vector<snapshot_entry> chunk(SNAPSHOT_CHUNK);
+    uint64_t checksum = 0;
+    for (uint64_t i = 0; ok && i < hdr.count; i += SNAPSHOT_CHUNK)
+    {
+      size_t n = std::min<uint64_t>(SNAPSHOT_CHUNK, hdr.count - i);
+      size_t bytes = n * sizeof(snapshot_entry);
+      ok = pread(fd, chunk.data(), bytes, sizeof(hdr) + i * sizeof(snapshot_entry)) ==
+           (ssize_t)bytes;
+      for (size_t j = 0; ok && j < n; j++)
+      {
+        keys[i + j] = chunk[j].key;
+        values[i + j] = (char *)chunk[j].value;
+        checksum = snapshot_checksum(checksum, chunk[j]);
+      }
+    }
+    ok = ok && checksum == hdr.checksum;
+  }
+  ::close(fd);
+  if (!ok)
+  {
+    error = std::string(path) + " is not a complete snapshot";
+    return false;
+  }
+  *lsn = hdr.lsn;
+  return true;
+}
+
+#endif
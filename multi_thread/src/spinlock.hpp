@@ -0,0 +1,174 @@
+#ifndef SPINLOCK_HPP
+#define SPINLOCK_HPP
+
+#include <atomic>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Page locks of the multi-threaded B+-tree. The tree takes the lock type as
+ * a template parameter, so every lock has the same interface:
+ *
+ *   lock() / unlock()     taken by writers around a page update
+ *   read_lock()           called by readers before reading a page
+ *   validate(version)     called by readers after reading a page, returns
+ *                         false if the page has to be read again
+ *
+ * A lock is embedded in the page header, it must fit in 8 bytes.
+ */
+
+// upper bound of the pause loop between two attempts
+#define SPIN_BACKOFF_MAX 1024
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_pause();
+#else
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+// Exponential backoff: pause 1, 2, 4, ... SPIN_BACKOFF_MAX times.
+class backoff
+{
+private:
+  uint32_t spins;
+
+public:
+  backoff() : spins(1) {}
+
+  void pause()
+  {
+    for (uint32_t i = 0; i < spins; i++)
+      cpu_relax();
+    if (spins < SPIN_BACKOFF_MAX)
+      spins <<= 1;
+  }
+};
+
+// test-and-set spin lock
+class spinlock{
+private:
+  std::atomic_flag flag;
+public:
+  spinlock() : flag(ATOMIC_FLAG_INIT) {}
+  void lock() {
+    while (flag.test_and_set(::std::memory_order_acquire));
+  }
+  void unlock() {
+    flag.clear(::std::memory_order_release);
+  }
+  // readers do not take the spin lock, they only check switch_counter
+  uint64_t read_lock() { return 0; }
+  bool validate(uint64_t) { return true; }
+};
+
+// Test-and-test-and-set spin lock: waiters spin on a plain load, which stays
+// in their cache until the owner releases the lock, and back off after every
+// failed exchange so the line is not bounced between the waiters.
+class ttas_spinlock{
+private:
+  std::atomic<bool> locked;
+public:
+  ttas_spinlock() : locked(false) {}
+  void lock() {
+    backoff b;
+    while (locked.exchange(true, ::std::memory_order_acquire))
+    {
+      while (locked.load(::std::memory_order_relaxed))
+        b.pause();
+    }
+  }
+  void unlock() {
+    locked.store(false, ::std::memory_order_release);
+  }
+  uint64_t read_lock() { return 0; }
+  bool validate(uint64_t) { return true; }
+};
+
+// Reader/writer spin lock: bit 0 is the writer, the other bits count the
+// readers. A writer sets its bit first and then waits for the readers to
+// drain, new readers wait while the bit is set, so writers do not starve.
+class rw_spinlock{
+private:
+  std::atomic<uint32_t> state;
+  static const uint32_t WRITER = 1;
+  static const uint32_t READER = 2;
+public:
+  rw_spinlock() : state(0) {}
+  void lock() {
+    backoff b;
+    uint32_t s = state.load(::std::memory_order_relaxed);
+    while ((s & WRITER) || !state.compare_exchange_weak(
+                               s, s | WRITER, ::std::memory_order_acquire))
+    {
+      b.pause();
+      s = state.load(::std::memory_order_relaxed);
+    }
+    while (state.load(::std::memory_order_acquire) != WRITER)
+      cpu_relax();
+  }
+  void unlock() {
+    state.store(0, ::std::memory_order_release);
+  }
+  void lock_shared() {
+    backoff b;
+    uint32_t s = state.load(::std::memory_order_relaxed);
+    while ((s & WRITER) || !state.compare_exchange_weak(
+                               s, s + READER, ::std::memory_order_acquire))
+    {
+      b.pause();
+      s = state.load(::std::memory_order_relaxed);
+    }
+  }
+  void unlock_shared() {
+    state.fetch_sub(READER, ::std::memory_order_release);
+  }
+  // readers hold the lock in shared mode while they read a page
+  uint64_t read_lock() {
+    lock_shared();
+    return 0;
+  }
+  bool validate(uint64_t) {
+    unlock_shared();
+    return true;
+  }
+};
+
+// Optimistic lock: the version is odd while a writer holds the lock and is
+// bumped on every unlock. Readers never write it, they remember an even
+// version before reading a page and validate it is unchanged afterwards.
+class version_lock{
+private:
+  std::atomic<uint64_t> version;
+public:
+  version_lock() : version(0) {}
+  void lock() {
+    backoff b;
+    uint64_t v = version.load(::std::memory_order_relaxed);
+    while ((v & 1) || !version.compare_exchange_weak(
+                          v, v + 1, ::std::memory_order_acquire))
+    {
+      b.pause();
+      v = version.load(::std::memory_order_relaxed);
+    }
+  }
+  void unlock() {
+    version.fetch_add(1, ::std::memory_order_release);
+  }
+  uint64_t read_lock() {
+    uint64_t v;
+    while ((v = version.load(::std::memory_order_acquire)) & 1)
+      cpu_relax();
+    return v;
+  }
+  bool validate(uint64_t v) {
+    ::std::atomic_thread_fence(::std::memory_order_acquire);
+    return version.load(::std::memory_order_relaxed) == v;
+  }
+};
+
+#endif
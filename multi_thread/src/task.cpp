@@ -15,28 +15,31 @@ typedef struct Row
 btree *bt = new btree();
 void insert(Row *rows, int nrows)
 {
-    // construct b plus tree index
-    
+    // construct b plus tree index, one traversal per run of keys of a leaf
+    vector<entry_key_t> keys(nrows);
+    vector<char *> ptrs(nrows);
     for (int i = 0; i < nrows; i++)
     {
-        bt->btree_insert(rows[i].b, (char *)&rows[i]);
+        keys[i] = rows[i].b;
+        ptrs[i] = (char *)&rows[i];
     }
+    bt->btree_insert_batch(keys.data(), ptrs.data(), nrows);
 }
 
-void search(int nrows, int proc){
+void search(){
     // printf("%d\n", (*(Row*)bt->btree_search(16)).a); // point query
     // printf("%x\n", bt->btree_search(16)); point query
-    unsigned long *bufs = new unsigned long[(nrows)*proc + nrows]{};
     int offset = 0;
-    bt->btree_search_range(START_INDEX, END_INDEX, bufs, offset);
+    bt->btree_scan(START_INDEX, END_INDEX, false, false,
+                   [&](entry_key_t, char *ptr) -> bool
+                   {
+                       auto tmp = *(Row *)ptr;
+                       offset++;
+                       if (1000 == tmp.a || 2000 == tmp.a || 3000 == tmp.a)
+                           printf("%d %d\n", tmp.a, tmp.b);
+                       return true;
+                   });
     cout << "offset: " << offset << endl;
-    for (int i = 0; i < offset; i++)
-    {
-        auto tmp = (*(Row *)(char *)bufs[i]);
-        if (1000 == tmp.a || 2000 == tmp.a || 3000 == tmp.a)
-            printf("%d %d\n", tmp.a, tmp.b);
-    }
-    delete[] bufs;
     return;
 }
 
@@ -70,7 +73,7 @@ int main(int argc, char *argv[])
         u.join();
     }
     
-    search(len, 4);
+    search();
     delete bt;
     return 0;
 }
@@ -0,0 +1,476 @@
+#ifndef WAL_HPP
+#define WAL_HPP
+
+#include "btree.hpp"
+#include "snapshot.hpp"
+#include <condition_variable>
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+/*
+ * Write-ahead log of the logical operations of a tree: one fixed size
+ * record per btree_insert or btree_delete, numbered by its log sequence
+ * number (LSN). Records are appended to a buffer in memory, commit(lsn)
+ * returns once the record is on disk. Commits are grouped: the first thread
+ * that commits while no write is running becomes the leader, writes all the
+ * buffered records with one pwrite and one fdatasync and wakes the others,
+ * whose records were in the batch. A commit waits for at most the write
+ * that is running and the next one, however many threads insert.
+ */
+
+#define WAL_MAGIC "DBEWALOG"
+#define WAL_VERSION 1
+
+enum wal_op : uint32_t
+{
+  WAL_INSERT = 1,
+  WAL_DELETE = 2
+};
+
+struct wal_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t first_lsn; // the LSN of the first record of the file
+  char reserved[40];
+};
+
+struct wal_record
+{
+  uint64_t lsn;
+  entry_key_t key;
+  uint64_t value;
+  uint32_t op;
+  uint32_t checksum; // of the other fields, a torn record fails it
+};
+
+static_assert(sizeof(wal_header) == 64, "wal_header is not 64 bytes");
+static_assert(sizeof(wal_record) == 32, "wal_record is not 32 bytes");
+
+static inline uint32_t wal_checksum(const wal_record &r)
+{
+  uint64_t h = r.lsn * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (uint64_t)r.key) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ r.value) * 0x94d049bb133111ebULL;
+  h = (h ^ r.op) * 0x9e3779b97f4a7c15ULL;
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+struct wal_stats
+{
+  uint64_t records; // appended
+  uint64_t syncs;   // group writes, one fdatasync each
+  uint64_t commits; // calls of commit
+};
+
+class write_ahead_log
+{
+private:
+  int fd;
+  std::string path_;
+  uint64_t first_lsn_; // of the file, the older records were truncated
+  off_t end;           // where the next group is written
+  std::mutex mutex;
+  std::condition_variable written;
+  std::vector<wal_record> buffer;  // appended, not written yet
+  std::vector<wal_record> writing; // the group of the leader
+  uint64_t next_lsn;
+  uint64_t durable_lsn; // the records up to it are on disk
+  bool flushing;
+  wal_stats stats_;
+
+  static wal_header new_header(uint64_t first_lsn)
+  {
+    wal_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, WAL_MAGIC, sizeof(hdr.magic));
+    hdr.version = WAL_VERSION;
+    hdr.record_size = sizeof(wal_record);
+    hdr.first_lsn = first_lsn;
+    return hdr;
+  }
+
+public:
+  write_ahead_log()
+      : fd(-1), first_lsn_(1), end(0), next_lsn(1), durable_lsn(0),
+        flushing(false), stats_{0, 0, 0}
+  {
+  }
+
+  ~write_ahead_log() { close(); }
+
+  write_ahead_log(const write_ahead_log &) = delete;
+  write_ahead_log &operator=(const write_ahead_log &) = delete;
+
+  // Opens the log at path, or creates it. Calls visit(record) for every
+  // complete record in LSN order; the log ends at the first record that is
+  // torn or out of sequence, which is cut off so new records follow the
+  // last good one.
+  template <typename Visitor>
+  bool open(const char *path, Visitor visit, std::string &error)
+  {
+    close();
+    fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+      error = std::string("cannot open ") + path + ": " + strerror(errno);
+      close();
+      return false;
+    }
+
+    wal_header hdr;
+    if (st.st_size == 0)
+    {
+      hdr = new_header(1);
+      if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+          fdatasync(fd) != 0 || !sync_directory(path))
+      {
+        error = std::string("cannot write ") + path + ": " + strerror(errno);
+        close();
+        return false;
+      }
+    }
+    else if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+             memcmp(hdr.magic, WAL_MAGIC, sizeof(hdr.magic)) != 0 ||
+             hdr.version != WAL_VERSION ||
+             hdr.record_size != sizeof(wal_record))
+    {
+      error = std::string(path) + " is not a write-ahead log";
+      close();
+      return false;
+    }
+
+    path_ = path;
+    first_lsn_ = hdr.first_lsn;
+    next_lsn = hdr.first_lsn;
+    end = sizeof(hdr);
+    std::vector<wal_record> chunk(4096);
+    for (;;)
+    {
+      ssize_t n = pread(fd, chunk.data(), chunk.size() * sizeof(wal_record), end);
+      if (n < (ssize_t)sizeof(wal_record))
+        break;
+      size_t i = 0;
+      for (; i < n / sizeof(wal_record); i++)
+      {
+        const wal_record &r = chunk[i];
+        if (r.lsn != next_lsn || r.checksum != wal_checksum(r) ||
+            (r.op != WAL_INSERT && r.op != WAL_DELETE))
+          break;
+        visit(r);
+        next_lsn++;
+      }
+      end += i * sizeof(wal_record);
+      if (i < chunk.size())
+        break;
+    }
+    if (end < st.st_size && ftruncate(fd, end) != 0)
+    {
+      error = std::string("cannot truncate ") + path + ": " + strerror(errno);
+      close();
+      return false;
+    }
+    durable_lsn = next_lsn - 1;
+    return true;
+  }
+
+  void close()
+  {
+    if (fd < 0)
+      return;
+    commit(UINT64_MAX);
+    ::close(fd);
+    fd = -1;
+  }
+
+  // Buffers a record and returns its LSN, it is durable after commit(lsn).
+  uint64_t append(wal_op op, entry_key_t key, uint64_t value)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    wal_record r;
+    r.lsn = next_lsn++;
+    r.key = key;
+    r.value = value;
+    r.op = op;
+    r.checksum = wal_checksum(r);
+    buffer.push_back(r);
+    stats_.records++;
+    return r.lsn;
+  }
+
+  // Waits until the records up to lsn are on disk, writing them if no other
+  // thread is. UINT64_MAX commits everything appended so far.
+  void commit(uint64_t lsn)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stats_.commits++;
+    lsn = std::min(lsn, next_lsn - 1);
+    while (durable_lsn < lsn)
+    {
+      if (flushing)
+      {
+        written.wait(lock);
+        continue;
+      }
+      // lead a group of everything appended so far
+      flushing = true;
+      writing.swap(buffer);
+      uint64_t last = next_lsn - 1;
+      off_t at = end;
+      end += writing.size() * sizeof(wal_record);
+      lock.unlock();
+
+      size_t bytes = writing.size() * sizeof(wal_record);
+      if (pwrite(fd, writing.data(), bytes, at) != (ssize_t)bytes)
+        LOG(FATAL) << "cannot write the log: " << strerror(errno);
+      if (fdatasync(fd) != 0)
+        LOG(FATAL) << "cannot sync the log: " << strerror(errno);
+
+      lock.lock();
+      writing.clear();
+      durable_lsn = last;
+      flushing = false;
+      stats_.syncs++;
+      written.notify_all();
+    }
+  }
+
+  // Drops the records up to lsn, which a checkpoint made redundant: the
+  // records after it are copied to a new file that is renamed over the log.
+  // Appends and commits wait meanwhile, only for the copy of the records
+  // written since the checkpoint began.
+  bool truncate(uint64_t lsn, std::string &error)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    written.wait(lock, [&] { return !flushing; });
+    lsn = std::min(lsn, durable_lsn);
+    if (lsn < first_lsn_)
+      return true;
+
+    std::string temp = path_ + ".tmp";
+    int out = ::open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    wal_header hdr = new_header(lsn + 1);
+    bool ok = out >= 0 && pwrite(out, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+    off_t from = sizeof(hdr) + (lsn + 1 - first_lsn_) * sizeof(wal_record);
+    std::vector<char> chunk(1 << 20);
+    for (off_t at = from; ok && at < end;)
+    {
+      size_t n = std::min<off_t>(chunk.size(), end - at);
+      ok = pread(fd, chunk.data(), n, at) == (ssize_t)n &&
+           pwrite(out, chunk.data(), n, sizeof(hdr) + (at - from)) == (ssize_t)n;
+      at += n;
+    }
+    ok = ok && fdatasync(out) == 0 && rename(temp.c_str(), path_.c_str()) == 0;
+    if (!ok)
+    {
+      error = "cannot truncate " + path_ + ": " + strerror(errno);
+      if (out >= 0)
+        ::close(out);
+      unlink(temp.c_str());
+      return false;
+    }
+    // once renamed the new file is the log, whether or not the rename is
+    // durable yet
+    ::close(fd);
+    fd = out;
+    end = sizeof(hdr) + (end - from);
+    first_lsn_ = lsn + 1;
+    if (!sync_directory(path_.c_str()))
+    {
+      error = "cannot truncate " + path_ + ": " + strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  // the LSN of the oldest record in the file
+  uint64_t first_lsn()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return first_lsn_;
+  }
+
+  uint64_t last_lsn()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return next_lsn - 1;
+  }
+
+  wal_stats stats()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats_;
+  }
+};
+
+// stripes of the key locks of basic_logged_btree
+#define WAL_KEY_STRIPES 64
+
+/*
+ * A basic_btree whose inserts and deletes are logged before they return.
+ * The values are logged as 64-bit integers, so they must still mean the
+ * same after a restart (row ids, offsets into a mapped file), not heap
+ * pointers, and must not be 0. The record of an operation is appended and
+ * the tree updated under the lock of the key's stripe, so two operations on
+ * the same key are applied in the order of their LSNs, as replay will.
+ *
+ * checkpoint writes the entries to a snapshot file while the operations go
+ * on, so the snapshot holds every record up to its LSN and, for every key,
+ * some of the records after it. Those are redone idempotently: an insert
+ * only if its (key, value) is missing, a delete removes the entry with its
+ * value if it is there. A key may hold several values, but not the same
+ * value twice, as replay could not tell the two entries apart.
+ */
+template <typename Lock>
+class basic_logged_btree
+{
+private:
+  basic_btree<Lock> *bt;
+  write_ahead_log log;
+  ttas_spinlock stripes[WAL_KEY_STRIPES];
+  std::mutex checkpointing;
+
+  ttas_spinlock &stripe(entry_key_t key)
+  {
+    return stripes[((uint64_t)key * 0x9e3779b97f4a7c15ULL) >> 58];
+  }
+
+  // the value of an entry of key, only value itself if it is not nullptr
+  char *find(entry_key_t key, char *value)
+  {
+    char *found = nullptr;
+    bt->btree_scan(key, key, true, true,
+                   [&](entry_key_t, char *ptr)
+                   {
+                     if (value == nullptr || ptr == value)
+                       found = ptr;
+                     return found == nullptr;
+                   });
+    return found;
+  }
+
+  void redo(const wal_record &r, bool idempotent)
+  {
+    if (r.op == WAL_INSERT &&
+        !(idempotent && find(r.key, (char *)r.value) != nullptr))
+      bt->btree_insert(r.key, (char *)r.value);
+    else if (r.op == WAL_DELETE)
+      bt->btree_delete(r.key, (char *)r.value);
+  }
+
+public:
+  basic_logged_btree() : bt(new basic_btree<Lock>()) {}
+  ~basic_logged_btree() { delete bt; }
+
+  // Opens the log at path and rebuilds the tree by redoing its records.
+  bool open(const char *path, std::string &error)
+  {
+    return open(path, nullptr, error);
+  }
+
+  // Rebuilds the tree from the checkpoint: bulk loads the snapshot, if the
+  // file exists, and redoes the records of the log after its LSN.
+  bool open(const char *path, const char *snapshot, std::string &error)
+  {
+    uint64_t snapshot_lsn = 0;
+    bool fuzzy = false; // the snapshot may hold records after its LSN
+    if (snapshot != nullptr)
+    {
+      vector<entry_key_t> keys;
+      vector<char *> values;
+      if (!read_snapshot(snapshot, keys, values, &snapshot_lsn, error))
+        return false;
+      bt->btree_bulk_load(keys.data(), values.data(), keys.size());
+      fuzzy = !keys.empty();
+    }
+    if (!log.open(
+            path,
+            [&](const wal_record &r)
+            {
+              if (r.lsn > snapshot_lsn)
+                redo(r, fuzzy);
+            },
+            error))
+      return false;
+    if (log.first_lsn() > snapshot_lsn + 1)
+    {
+      error = std::string(path) + " starts at LSN " +
+              std::to_string(log.first_lsn()) + ", the snapshot is missing";
+      return false;
+    }
+    return true;
+  }
+
+  // Writes the entries of the tree to the snapshot file in key order while
+  // the operations go on, then drops the log records it holds. Operations
+  // only wait while the stripes are locked to read the LSN and while the
+  // log is cut.
+  bool checkpoint(const char *snapshot, std::string &error)
+  {
+    std::lock_guard<std::mutex> guard(checkpointing);
+    // with every stripe held, every record appended has been applied
+    for (auto &l : stripes)
+      l.lock();
+    uint64_t lsn = log.last_lsn();
+    for (auto &l : stripes)
+      l.unlock();
+
+    snapshot_writer out;
+    if (!out.open(snapshot, error))
+      return false;
+    bt->btree_scan(LLONG_MIN, LLONG_MAX, true, true,
+                   [&](entry_key_t key, char *value)
+                   {
+                     out.add(key, (uint64_t)value);
+                     return true;
+                   });
+    // the scan saw operations after lsn, whose records must be on disk
+    // before the snapshot is
+    log.commit(UINT64_MAX);
+    return out.finish(lsn, error) && log.truncate(lsn, error);
+  }
+
+  void btree_insert(entry_key_t key, char *value)
+  {
+    ttas_spinlock &l = stripe(key);
+    l.lock();
+    uint64_t lsn = log.append(WAL_INSERT, key, (uint64_t)value);
+    bt->btree_insert(key, value);
+    l.unlock();
+    log.commit(lsn);
+  }
+
+  // deletes an entry of key, the record holds its value
+  void btree_delete(entry_key_t key)
+  {
+    ttas_spinlock &l = stripe(key);
+    l.lock();
+    char *value = find(key, nullptr);
+    if (value == nullptr)
+    {
+      l.unlock();
+      return;
+    }
+    uint64_t lsn = log.append(WAL_DELETE, key, (uint64_t)value);
+    bt->btree_delete(key, value);
+    l.unlock();
+    log.commit(lsn);
+  }
+
+  char *btree_search(entry_key_t key) { return bt->btree_search(key); }
+
+  // the tree, for searches and scans
+  basic_btree<Lock> *tree() { return bt; }
+  write_ahead_log &wal() { return log; }
+};
+
+typedef basic_logged_btree<page_lock> logged_btree;
+
+#endif
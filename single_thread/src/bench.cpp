@@ -0,0 +1,606 @@
+#include "btree.hpp"
+#include "csv_loader.hpp"
+#include "disk_btree.hpp"
+#include "query.hpp"
+#include "table_file.hpp"
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <glog/logging.h>  // yum install glog glog-devel
+#include <gflags/gflags.h> // yum install gflags gflags-devel
+
+DEFINE_string(benchmarks, "lookup,lookupbatch,miss,range,insert,batch,bulkload,parallel,filter,load,disk", "comma separated list of benchmarks to run");
+DEFINE_int32(num_keys, 1000000, "number of keys loaded into the tree");
+DEFINE_int32(num_ops, 1000000, "number of operations of each benchmark");
+DEFINE_int32(range_size, 100, "number of keys covered by one range search");
+DEFINE_int32(seed, 42, "random seed");
+DEFINE_double(fill_factor, 1.0, "fill factor of the bulk loaded pages");
+DEFINE_string(filter, "a between 1000 and 2000 or a in (3000, 4000, 4500)", "where clause of the filter benchmark, a table scan of num_keys rows");
+DEFINE_int32(pool_pages, 1024, "buffer pool frames of the disk benchmark, of DISK_PAGESIZE bytes each");
+DEFINE_int32(max_threads, std::thread::hardware_concurrency(), "the parallel bulk load and csv load double the thread count from 1 up to this");
+
+static const char *search_mode()
+{
+#if defined(SIMD_SEARCH)
+    return rank_isa_name(cpu_rank_isa);
+#elif defined(BINARY_SEARCH)
+    return "binary";
+#else
+    return "linear";
+#endif
+}
+
+static const char *page_layout()
+{
+#ifdef SOA_PAGE
+    return "soa";
+#else
+    return "aos";
+#endif
+}
+
+// a hardware event counted for this thread, invalid if perf is not allowed
+class perf_counter
+{
+private:
+    int fd;
+
+public:
+    perf_counter(uint32_t type, uint64_t config)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    ~perf_counter()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool valid() { return fd >= 0; }
+
+    long long read_count()
+    {
+        long long count = 0;
+        if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+            return -1;
+        return count;
+    }
+};
+
+// time and cache misses from construction to report()
+class measurement
+{
+private:
+    perf_counter l1d_misses;
+    perf_counter llc_misses;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    measurement()
+        : l1d_misses(PERF_TYPE_HW_CACHE,
+                     PERF_COUNT_HW_CACHE_L1D |
+                         (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)),
+          llc_misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES),
+          start(std::chrono::steady_clock::now())
+    {
+    }
+
+    void report(const char *name, long ops)
+    {
+        double ns = std::chrono::duration<double, std::nano>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+        long long l1d = l1d_misses.read_count();
+        long long llc = llc_misses.read_count();
+
+        printf("%-11s %-6s %-3s %12.1f ns/op %12.0f ops/s", name, search_mode(),
+               page_layout(), ns / ops, ops * 1e9 / ns);
+        if (l1d >= 0)
+            printf(" %8.2f L1D-miss/op", (double)l1d / ops);
+        if (llc >= 0)
+            printf(" %8.2f LLC-miss/op", (double)llc / ops);
+        printf("\n");
+    }
+};
+
+// keys 0, 2, 4, ... inserted in random order
+static vector<entry_key_t> make_keys(int num_keys)
+{
+    vector<entry_key_t> keys(num_keys);
+    for (int i = 0; i < num_keys; i++)
+        keys[i] = (entry_key_t)i * 2;
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(FLAGS_seed));
+    return keys;
+}
+
+static btree *load(const vector<entry_key_t> &keys)
+{
+    btree *bt = new btree();
+    for (size_t i = 0; i < keys.size(); i++)
+        bt->btree_insert(keys[i], (char *)(keys[i] + 1));
+    return bt;
+}
+
+static void bench_lookup(btree *bt, const vector<entry_key_t> &keys)
+{
+    std::mt19937_64 rng(FLAGS_seed + 1);
+    vector<entry_key_t> probes(FLAGS_num_ops);
+    for (auto &p : probes)
+        p = keys[rng() % keys.size()];
+
+    unsigned long sum = 0;
+    measurement m;
+    for (auto p : probes)
+        sum += (unsigned long)bt->btree_search(p);
+    m.report("lookup", probes.size());
+    LOG_IF(FATAL, sum == 0) << "lookups returned nothing" << endl;
+}
+
+// lookups of keys that are not in the tree, the odd numbers
+static void bench_miss(btree *bt, const vector<entry_key_t> &keys)
+{
+    std::mt19937_64 rng(FLAGS_seed + 3);
+    vector<entry_key_t> probes(FLAGS_num_ops);
+    for (auto &p : probes)
+        p = keys[rng() % keys.size()] + 1;
+
+    unsigned long sum = 0;
+    measurement m;
+    for (auto p : probes)
+        sum += (unsigned long)bt->btree_search(p);
+    m.report("miss", probes.size());
+    LOG_IF(FATAL, sum != 0) << "lookups of missing keys found a value" << endl;
+}
+
+// the same probes as bench_lookup, looked up in batches of num_ops keys
+static void bench_lookup_batch(btree *bt, const vector<entry_key_t> &keys)
+{
+    std::mt19937_64 rng(FLAGS_seed + 1);
+    vector<entry_key_t> probes(FLAGS_num_ops);
+    for (auto &p : probes)
+        p = keys[rng() % keys.size()];
+    vector<char *> results(probes.size());
+
+    unsigned long sum = 0;
+    measurement m;
+    bt->btree_search_batch(probes.data(), probes.size(), results.data());
+    for (auto r : results)
+        sum += (unsigned long)r;
+    m.report("lookupbatch", probes.size());
+    LOG_IF(FATAL, sum == 0) << "lookups returned nothing" << endl;
+}
+
+static void bench_range(btree *bt, const vector<entry_key_t> &keys)
+{
+    std::mt19937_64 rng(FLAGS_seed + 2);
+    unsigned long *buf = new unsigned long[FLAGS_range_size + 1];
+    long found = 0;
+    measurement m;
+    for (int i = 0; i < FLAGS_num_ops; i++)
+    {
+        entry_key_t min = keys[rng() % keys.size()];
+        int offset = 0;
+        bt->btree_search_range(min, min + 2 * FLAGS_range_size, buf, offset);
+        found += offset;
+    }
+    m.report("range", FLAGS_num_ops);
+    LOG_IF(FATAL, found == 0) << "range searches returned nothing" << endl;
+    delete[] buf;
+}
+
+// builds a tree of all the keys by inserting them one at a time
+static void bench_insert(const vector<entry_key_t> &keys)
+{
+    measurement m;
+    btree *bt = load(keys);
+    m.report("insert", keys.size());
+    delete bt;
+}
+
+// builds a tree of all the keys by inserting batches of num_ops keys
+static void bench_batch(const vector<entry_key_t> &keys)
+{
+    vector<char *> ptrs(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        ptrs[i] = (char *)(keys[i] + 1);
+
+    measurement m;
+    btree *bt = new btree();
+    for (size_t i = 0; i < keys.size(); i += FLAGS_num_ops)
+        bt->btree_insert_batch(keys.data() + i, ptrs.data() + i,
+                               std::min(keys.size() - i, (size_t)FLAGS_num_ops));
+    m.report("batch", keys.size());
+    delete bt;
+}
+
+// builds a tree of all the keys bottom-up, from the shuffled and the sorted keys
+static void bench_bulkload(const vector<entry_key_t> &keys)
+{
+    vector<char *> ptrs(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        ptrs[i] = (char *)(keys[i] + 1);
+
+    {
+        measurement m;
+        btree *bt = new btree();
+        bt->btree_bulk_load(keys.data(), ptrs.data(), keys.size(),
+                            FLAGS_fill_factor);
+        m.report("bulkload", keys.size());
+        delete bt;
+    }
+
+    vector<entry_key_t> sorted_keys(keys);
+    std::sort(sorted_keys.begin(), sorted_keys.end());
+    for (size_t i = 0; i < keys.size(); i++)
+        ptrs[i] = (char *)(sorted_keys[i] + 1);
+    {
+        measurement m;
+        btree *bt = new btree();
+        bt->btree_bulk_load(sorted_keys.data(), ptrs.data(), sorted_keys.size(),
+                            FLAGS_fill_factor);
+        m.report("bulksorted", keys.size());
+        delete bt;
+    }
+}
+
+// builds a tree of all the shuffled keys bottom-up with 1, 2, 4, ... threads
+static void bench_parallel(const vector<entry_key_t> &keys)
+{
+    vector<char *> ptrs(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        ptrs[i] = (char *)(keys[i] + 1);
+
+    double base = 0;
+    for (int threads = 1; threads <= std::max(FLAGS_max_threads, 1); threads *= 2)
+    {
+        auto start = std::chrono::steady_clock::now();
+        btree *bt = new btree();
+        bt->btree_bulk_load_parallel(keys.data(), ptrs.data(), keys.size(),
+                                     threads, FLAGS_fill_factor);
+        double ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+        if (threads == 1)
+            base = ms;
+        printf("parallel    %3d threads %10.1f ms %6.2fx\n", threads, ms,
+               base / ms);
+        delete bt;
+    }
+}
+
+// num_keys rows shaped like generateData
+static vector<Row> make_rows(uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    vector<Row> rows(FLAGS_num_keys);
+    for (auto &r : rows)
+    {
+        r.a = rng() % (5000 - 1000 + 1) + 1000;
+        r.b = rng() % (100 - 20 + 1) + 20;
+    }
+    return rows;
+}
+
+// filters num_keys rows with the vectorized column kernels, then one row at
+// a time through Row pointers
+static void bench_filter()
+{
+    vector<Row> rows = make_rows(FLAGS_seed + 3);
+    column_table table(rows.data(), rows.size());
+
+    string error;
+    expr *where = parse_where(FLAGS_filter, error);
+    LOG_IF(FATAL, where == nullptr) << "invalid filter: " << error << endl;
+    query q(where, NUM_COLUMNS); // no index, a table scan
+
+    long found = 0;
+    {
+        measurement m;
+        q.run(nullptr, nullptr, table, [&](const Row *) { found++; });
+        m.report("filter", rows.size());
+    }
+
+    long expected = 0;
+    {
+        measurement m;
+        for (auto &r : rows)
+            expected += eval_row(where, &r);
+        m.report("filterrow", rows.size());
+    }
+    LOG_IF(FATAL, found != expected) << "filter found " << found
+                                     << " rows instead of " << expected << endl;
+    printf("filter      %ld of %zu rows, %.1f MB of columns\n", found,
+           rows.size(), rows.size() * sizeof(Row) / 1e6);
+}
+
+// reads num_keys rows back from a CSV file with fscanf like the task used
+// to and with load_csv on up to max_threads threads, then from a binary
+// table file, then maps a table file in the rows layout
+static void bench_load()
+{
+    vector<Row> rows = make_rows(FLAGS_seed + 4);
+    const char *csv = "bench_load.txt";
+    const char *tbl = "bench_load.tbl";
+    FILE *out = fopen(csv, "w");
+    LOG_IF(FATAL, out == NULL) << "cannot open " << csv << endl;
+    for (auto &r : rows)
+        fprintf(out, "%d,%d\n", r.a, r.b);
+    fclose(out);
+    string error;
+    LOG_IF(FATAL, !write_table(tbl, rows.data(), rows.size(), error)) << error;
+
+    auto same = [&](const vector<Row> &loaded) {
+        return loaded.size() == rows.size() &&
+               std::equal(rows.begin(), rows.end(), loaded.begin(),
+                          [](const Row &x, const Row &y)
+                          { return x.a == y.a && x.b == y.b; });
+    };
+    {
+        vector<Row> loaded(rows.size());
+        measurement m;
+        FILE *in = fopen(csv, "r");
+        for (auto &r : loaded)
+            if (fscanf(in, "%d,%d", &r.a, &r.b) != 2)
+                break;
+        fclose(in);
+        m.report("loadcsv", rows.size());
+        LOG_IF(FATAL, !same(loaded)) << "the csv rows differ" << endl;
+    }
+    for (int threads = 1; threads <= std::max(FLAGS_max_threads, 1); threads *= 2)
+    {
+        vector<Row> loaded;
+        csv_stats stats;
+        LOG_IF(FATAL, !load_csv(csv, loaded, threads, &stats, error))
+            << error << endl;
+        LOG_IF(FATAL, !same(loaded)) << "the parsed csv rows differ" << endl;
+        printf("loadcsvpar  %3d threads %12.1f ns/op %9.1f Mrows/s %7.1f MB/s\n",
+               threads, stats.seconds * 1e9 / stats.rows,
+               stats.rows_per_sec() / 1e6, stats.mb_per_sec());
+    }
+    {
+        vector<Row> loaded;
+        measurement m;
+        LOG_IF(FATAL, !load_table(tbl, loaded, error)) << error << endl;
+        m.report("loadbinary", rows.size());
+        LOG_IF(FATAL, !same(loaded)) << "the binary rows differ" << endl;
+    }
+    LOG_IF(FATAL, !write_table(tbl, rows.data(), rows.size(), error, TABLE_ROWS))
+        << error << endl;
+    {
+        mapped_table mapped;
+        measurement m;
+        LOG_IF(FATAL, !mapped.open(tbl, error)) << error << endl;
+        m.report("loadmmap", rows.size());
+        vector<Row> loaded(mapped.rows(), mapped.rows() + mapped.num_rows());
+        LOG_IF(FATAL, !same(loaded)) << "the mapped rows differ" << endl;
+    }
+    remove(csv);
+    remove(tbl);
+}
+
+// Point lookups of a hot set of keys that fits in the buffer pool,
+// interleaved with range scans over twice as many leaves as the pool
+// holds, once with each replacement policy. The scans should not evict the
+// pages of the lookups.
+static void bench_disk_mixed(const char *path, const vector<entry_key_t> &keys)
+{
+    entry_key_t scan_width = (entry_key_t)FLAGS_pool_pages * disk_cardinality * 4;
+    vector<entry_key_t> hot(keys.begin(),
+                            keys.begin() + std::min<size_t>(keys.size(),
+                                                            FLAGS_pool_pages / 2));
+    for (auto policy : {REPLACE_CLOCK, REPLACE_2Q})
+    {
+        disk_btree bt;
+        string error;
+        LOG_IF(FATAL, !bt.open(path, FLAGS_pool_pages, error, policy))
+            << error << endl;
+        std::mt19937_64 rng(FLAGS_seed + 5);
+        double ns = 0;
+        uint64_t hits = 0, misses = 0;
+        long lookups = 0, scanned = 0;
+        for (int round = 0; round < 100; round++)
+        {
+            entry_key_t min = rng() % (2 * keys.size());
+            bt.btree_scan(min, min + scan_width, true, false,
+                          [&](entry_key_t, uint64_t) {
+                              scanned++;
+                              return true;
+                          });
+            bt.buffer().reset_stats();
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < 1000; i++, lookups++)
+            {
+                uint64_t value;
+                bt.btree_search(hot[rng() % hot.size()], &value);
+            }
+            ns += std::chrono::duration<double, std::nano>(
+                      std::chrono::steady_clock::now() - start).count();
+            hits += bt.buffer().stats().hits;
+            misses += bt.buffer().stats().misses;
+        }
+        printf("diskmixed   %-5s %12.1f ns/lookup %6.3f lookup hit rate, %ld keys scanned\n",
+               policy == REPLACE_2Q ? "2q" : "clock", ns / lookups,
+               hits / (double)(hits + misses), scanned);
+    }
+}
+
+// Scans the whole index with a cold buffer pool and page cache, once per
+// io_backend: page by page with pread, then reading DISK_READAHEAD leaves
+// ahead with the thread pool and with io_uring.
+static void bench_disk_scan(const char *path)
+{
+    for (auto backend : {IO_SYNC, IO_THREADS, IO_URING})
+    {
+        int fd = open(path, O_RDONLY);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+
+        disk_btree bt;
+        string error;
+        LOG_IF(FATAL, !bt.open(path, FLAGS_pool_pages, error, REPLACE_2Q, backend))
+            << error << endl;
+        long scanned = 0;
+        auto start = std::chrono::steady_clock::now();
+        bt.btree_scan(LLONG_MIN, LLONG_MAX, true, true,
+                      [&](entry_key_t, uint64_t) {
+                          scanned++;
+                          return true;
+                      });
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start).count();
+        const buffer_stats &stats = bt.buffer().stats();
+        printf("diskscan    %-8s %10.1f ms %8.1f MB/s %8lu reads %8lu read ahead\n",
+               io_backend_name(bt.buffer().backend()), seconds * 1e3,
+               bt.num_pages() * DISK_PAGESIZE / seconds / 1e6,
+               (unsigned long)stats.misses, (unsigned long)stats.prefetches);
+        LOG_IF(FATAL, scanned != (long)bt.size()) << "the scan missed keys" << endl;
+    }
+}
+
+// the same keys in a disk_btree whose buffer pool holds pool_pages pages:
+// bulk load, lookups, range scans and inserts, with the pages read and
+// written per operation, then bench_disk_mixed and bench_disk_scan
+static void bench_disk(const vector<entry_key_t> &keys)
+{
+    const char *path = "bench_disk.idx";
+    remove(path);
+    disk_btree bt;
+    string error;
+    LOG_IF(FATAL, !bt.open(path, FLAGS_pool_pages, error)) << error << endl;
+    vector<uint64_t> values(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        values[i] = keys[i] + 1;
+
+    auto report = [&](const char *name, measurement &m, long ops) {
+        const buffer_stats &stats = bt.buffer().stats();
+        m.report(name, ops);
+        printf("%-11s %6.3f hit rate %8.2f reads/op %8.2f writes/op\n", name,
+               stats.hit_rate(), (double)stats.misses / ops,
+               (double)stats.writes / ops);
+        bt.buffer().reset_stats();
+    };
+    {
+        measurement m;
+        bt.btree_bulk_load(keys.data(), values.data(), keys.size());
+        LOG_IF(FATAL, !bt.flush(error)) << error << endl;
+        report("diskload", m, keys.size());
+    }
+    printf("disk        %lu pages of %d bytes, %u levels, %d frames\n",
+           (unsigned long)bt.num_pages(), DISK_PAGESIZE, bt.levels(),
+           FLAGS_pool_pages);
+
+    std::mt19937_64 rng(FLAGS_seed + 1);
+    unsigned long sum = 0;
+    {
+        measurement m;
+        for (int i = 0; i < FLAGS_num_ops; i++)
+        {
+            uint64_t value = 0;
+            bt.btree_search(keys[rng() % keys.size()], &value);
+            sum += value;
+        }
+        report("disklookup", m, FLAGS_num_ops);
+    }
+    LOG_IF(FATAL, sum == 0) << "lookups returned nothing" << endl;
+    {
+        int num_scans = std::max(FLAGS_num_ops / 100, 1);
+        measurement m;
+        long found = 0;
+        for (int i = 0; i < num_scans; i++)
+        {
+            entry_key_t min = keys[rng() % keys.size()];
+            bt.btree_scan(min, min + 2 * FLAGS_range_size, true, false,
+                          [&](entry_key_t, uint64_t) {
+                              found++;
+                              return true;
+                          });
+        }
+        report("diskrange", m, num_scans);
+    }
+    {
+        int num_inserts = std::max(FLAGS_num_ops / 10, 1);
+        measurement m;
+        for (int i = 0; i < num_inserts; i++)
+        {
+            entry_key_t key = keys[rng() % keys.size()] + 1;
+            bt.btree_insert(key, key + 1);
+        }
+        LOG_IF(FATAL, !bt.flush(error)) << error << endl;
+        report("diskinsert", m, num_inserts);
+    }
+    bt.close();
+    bench_disk_mixed(path, keys);
+    bench_disk_scan(path);
+    remove(path);
+}
+
+int main(int argc, char *argv[])
+{
+    google::ParseCommandLineFlags(&argc, &argv, true);
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_log_dir = "./logs";
+    FLAGS_minloglevel = google::GLOG_WARNING; // the tree logs every operation
+
+    vector<entry_key_t> keys = make_keys(FLAGS_num_keys);
+    btree *bt = load(keys);
+    printf("keys: %d, page size: %d, cardinality: %d\n", FLAGS_num_keys,
+           PAGESIZE, cardinality);
+#ifdef BLOOM_FILTER
+    printf("lookups check a counting Bloom filter of %d counters per key first\n",
+           BLOOM_COUNTERS_PER_KEY);
+#endif
+    if (!perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES).valid())
+        printf("cache misses are not reported, perf_event_open is not allowed\n");
+
+    std::stringstream benchmarks(FLAGS_benchmarks);
+    string name;
+    while (std::getline(benchmarks, name, ','))
+    {
+        if (name == "lookup")
+            bench_lookup(bt, keys);
+        else if (name == "lookupbatch")
+            bench_lookup_batch(bt, keys);
+        else if (name == "miss")
+            bench_miss(bt, keys);
+        else if (name == "range")
+            bench_range(bt, keys);
+        else if (name == "insert")
+            bench_insert(keys);
+        else if (name == "batch")
+            bench_batch(keys);
+        else if (name == "bulkload")
+            bench_bulkload(keys);
+        else if (name == "parallel")
+            bench_parallel(keys);
+        else if (name == "filter")
+            bench_filter();
+        else if (name == "load")
+            bench_load();
+        else if (name == "disk")
+            bench_disk(keys);
+        else
+            LOG(ERROR) << "unknown benchmark: " << name << endl;
+    }
+
+    delete bt;
+    return 0;
+}
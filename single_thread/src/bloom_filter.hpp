@@ -0,0 +1,115 @@
+#ifndef BLOOM_FILTER_HPP
+#define BLOOM_FILTER_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// counters per key the filter is sized for, and counters set by a key
+#define BLOOM_COUNTERS_PER_KEY 16
+#define BLOOM_PROBES 6
+
+/*
+ * Blocked counting Bloom filter of int64 keys. A key maps to one block of
+ * 128 4-bit counters, a cache line, and increments BLOOM_PROBES counters of
+ * it, so a lookup reads one line. The counters make keys removable; a
+ * counter that reached 15 stays there, which only costs false positives.
+ */
+class counting_bloom_filter
+{
+private:
+  static const int block_words = 8; // 16 counters per word
+
+  uint64_t *blocks;
+  size_t num_blocks;
+  size_t capacity_; // keys the filter is sized for
+  size_t size_;     // keys added and not removed
+
+  static uint64_t mix(uint64_t x)
+  {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+  }
+
+  // the block of the key, and the BLOOM_PROBES 7-bit counter indexes in it
+  uint64_t *block(int64_t key, uint64_t *indexes) const
+  {
+    uint64_t h = mix((uint64_t)key);
+    *indexes = mix(h);
+    return blocks + ((h >> 32) * num_blocks >> 32) * block_words;
+  }
+
+public:
+  counting_bloom_filter(size_t capacity = 1024) : blocks(nullptr)
+  {
+    reset(capacity);
+  }
+
+  ~counting_bloom_filter() { free(blocks); }
+
+  counting_bloom_filter(const counting_bloom_filter &) = delete;
+  counting_bloom_filter &operator=(const counting_bloom_filter &) = delete;
+
+  // empties the filter and sizes it for capacity keys
+  void reset(size_t capacity)
+  {
+    free(blocks);
+    capacity_ = capacity;
+    size_ = 0;
+    num_blocks = (capacity * BLOOM_COUNTERS_PER_KEY + 127) / 128;
+    void *p;
+    posix_memalign(&p, 64, num_blocks * block_words * sizeof(uint64_t));
+    blocks = (uint64_t *)p;
+    memset(blocks, 0, num_blocks * block_words * sizeof(uint64_t));
+  }
+
+  size_t capacity() const { return capacity_; }
+  size_t size() const { return size_; }
+
+  void add(int64_t key)
+  {
+    uint64_t g;
+    uint64_t *b = block(key, &g);
+    for (int i = 0; i < BLOOM_PROBES; i++, g >>= 7)
+    {
+      int shift = (g & 15) * 4;
+      uint64_t &w = b[(g >> 4) & 7];
+      if ((w >> shift & 15) != 15)
+        w += 1ULL << shift;
+    }
+    size_++;
+  }
+
+  // the key must have been added
+  void remove(int64_t key)
+  {
+    uint64_t g;
+    uint64_t *b = block(key, &g);
+    for (int i = 0; i < BLOOM_PROBES; i++, g >>= 7)
+    {
+      int shift = (g & 15) * 4;
+      uint64_t &w = b[(g >> 4) & 7];
+      uint64_t c = w >> shift & 15;
+      if (c != 0 && c != 15)
+        w -= 1ULL << shift;
+    }
+    size_--;
+  }
+
+  // false if the key was never added or has been removed
+  bool may_contain(int64_t key) const
+  {
+    uint64_t g;
+    const uint64_t *b = block(key, &g);
+    bool all = true;
+    for (int i = 0; i < BLOOM_PROBES; i++, g >>= 7)
+      all &= (b[(g >> 4) & 7] >> ((g & 15) * 4) & 15) != 0;
+    return all;
+  }
+};
+
+#endif
@@ -1,3 +1,7 @@
+#ifndef BTREE_HPP
+#define BTREE_HPP
+
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <iostream>
@@ -7,12 +11,51 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <thread>
 #include <vector>
 #include <glog/logging.h> 
 #include <gflags/gflags.h>
 
+#ifndef PAGESIZE
 #define PAGESIZE 512
+#endif
+
+// The slots of a page are scanned linearly unless BINARY_SEARCH or SIMD_SEARCH
+// is defined, both of which rank the key among the sorted slots instead.
+#ifdef SIMD_SEARCH
+#include "simd_search.hpp"
+#endif
+#if defined(BINARY_SEARCH) || defined(SIMD_SEARCH)
+#define RANK_SEARCH
+#endif
+
+// btree_search_batch walks this many keys through the tree in lockstep and
+// prefetches up to SEARCH_PREFETCH_BYTES of every page it is about to search
+#ifndef SEARCH_BATCH_GROUP
+#define SEARCH_BATCH_GROUP 32
+#endif
+#define SEARCH_PREFETCH_BYTES 512
+
+static inline void prefetch_page(const void *p)
+{
+  for (int off = 0; off < std::min(PAGESIZE, SEARCH_PREFETCH_BYTES); off += 64)
+    __builtin_prefetch((const char *)p + off);
+}
+
 using entry_key_t = int64_t;
+
+// Compile with BLOOM_FILTER to keep a counting Bloom filter of the keys of
+// the tree, so a lookup of a key that is not in it returns before the descent.
+#ifdef BLOOM_FILTER
+#include "bloom_filter.hpp"
+#endif
+
+// the predicate of btree_scan, btree_scan_where takes any callable
+// bool(entry_key_t key, char *ptr) instead
+struct accept_all
+{
+  bool operator()(entry_key_t, char *) const { return true; }
+};
 using namespace std;
 class page;
 
@@ -22,6 +65,14 @@ private:
   int height;
   char *root;
 
+  page *bulk_leaf(const entry_key_t *, char *const *, size_t, size_t);
+  void bulk_build_levels(vector<page *> &, vector<entry_key_t> &, double);
+#ifdef BLOOM_FILTER
+  counting_bloom_filter filter;
+  void filter_add(const entry_key_t *, size_t);
+  void filter_rebuild(size_t);
+#endif
+
 public:
   btree();
   void setNewRoot(char *);
@@ -31,7 +82,20 @@ public:
   void btree_delete_internal(entry_key_t, char *, uint32_t, entry_key_t *,
                              bool *, page **);
   char *btree_search(entry_key_t);
+  void btree_search_batch(const entry_key_t *, size_t, char **);
   void btree_search_range(entry_key_t, entry_key_t, unsigned long *, int &offset);
+  template <typename Visitor>
+  void btree_scan(entry_key_t, entry_key_t, bool, bool, Visitor);
+  template <typename Predicate, typename Visitor>
+  void btree_scan_where(entry_key_t, entry_key_t, bool, bool, Predicate,
+                        Visitor);
+  template <typename Visitor>
+  void btree_scan_reverse(entry_key_t, entry_key_t, bool, bool, Visitor);
+  void btree_bulk_load(const entry_key_t *, char *const *, size_t,
+                       double fill_factor = 1.0);
+  void btree_insert_batch(const entry_key_t *, char *const *, size_t);
+  void btree_bulk_load_parallel(const entry_key_t *, char *const *, size_t,
+                                int num_threads, double fill_factor = 1.0);
   friend class page;
 };
 
@@ -40,11 +104,11 @@ class header
 private:
   page *leftmost_ptr;     // 8 bytes
   page *sibling_ptr;      // 8 bytes
+  page *prev_ptr;         // 8 bytes, left sibling
   uint32_t level;         // 4 bytes
   uint8_t switch_counter; // 1 bytes
   uint8_t is_deleted;     // 1 bytes
   int16_t last_index;     // 2 bytes
-  char dummy[8];          // 8 bytes
 
   friend class page;
   friend class btree;
@@ -54,6 +118,7 @@ public:
   {
     leftmost_ptr = nullptr;
     sibling_ptr = nullptr;
+    prev_ptr = nullptr;
     switch_counter = 0;
     last_index = -1;
     is_deleted = false;
@@ -80,11 +145,48 @@ public:
 
 const int cardinality = (PAGESIZE - sizeof(header)) / sizeof(entry); // total number of entry
 
+#ifdef SOA_PAGE
+// Structure of arrays slots: the keys of a page are contiguous and followed
+// by the pointers, so a search only pulls the key cache lines. records[i]
+// returns references to both halves of slot i, so records[i].key and
+// records[i].ptr read and write the same way as with the entry array.
+class soa_slots
+{
+private:
+  entry_key_t keys[cardinality]; // 8 bytes * n
+  char *ptrs[cardinality];       // 8 bytes * n
+
+public:
+  struct slot
+  {
+    entry_key_t &key;
+    char *&ptr;
+  };
+
+  soa_slots()
+  {
+    for (int i = 0; i < cardinality; i++)
+    {
+      keys[i] = LONG_MAX;
+      ptrs[i] = nullptr;
+    }
+  }
+
+  inline slot operator[](int i) { return slot{keys[i], ptrs[i]}; }
+};
+
+typedef soa_slots slot_array;
+const int key_stride = 1; // distance between two keys in entry_key_t
+#else
+typedef entry slot_array[cardinality];
+const int key_stride = sizeof(entry) / sizeof(entry_key_t);
+#endif
+
 class page
 {
 private:
   header hdr;                 // header in memory, 32 bytes
-  entry records[cardinality]; // slots in memory, 16 bytes * 30
+  slot_array records;         // slots in memory, 16 bytes * 30
 
 public:
   friend class btree;
@@ -143,6 +245,31 @@ public:
     return count;
   }
 
+#ifdef RANK_SEARCH
+  // Number of slots in [0, num_entries) whose key is less than key, or less
+  // than or equal to key if inclusive is set. Keys stay non-decreasing while
+  // insert_key shifts entries, so the result is well defined for readers too.
+  inline int rank(entry_key_t key, int num_entries, bool inclusive)
+  {
+#ifdef SIMD_SEARCH
+    return simd_rank<key_stride>(&records[0].key, num_entries, key,
+                                 inclusive);
+#else
+    // branch free: the halving is compiled to conditional moves
+    int lo = 0, n = num_entries;
+    while (n > 0)
+    {
+      int half = n >> 1;
+      entry_key_t k = records[lo + half].key;
+      bool right = (k < key) | (inclusive & (k == key));
+      lo = right ? lo + half + 1 : lo;
+      n = right ? n - half - 1 : half;
+    }
+    return lo;
+#endif
+  }
+#endif
+
   inline bool remove_key(entry_key_t key)
   {
     // Set the switch_counter
@@ -292,6 +419,7 @@ public:
 
         page *new_sibling = new page(hdr.level);
         new_sibling->hdr.sibling_ptr = hdr.sibling_ptr;
+        new_sibling->hdr.prev_ptr = left_sibling;
 
         int num_dist_entries = num_entries - m;
         int new_sibling_cnt = 0;
@@ -336,6 +464,8 @@ public:
 
           left_sibling->hdr.sibling_ptr = new_sibling;
         }
+        if (new_sibling->hdr.sibling_ptr)
+          new_sibling->hdr.sibling_ptr->hdr.prev_ptr = new_sibling;
 
         if (left_sibling == ((page *)bt->root))
         {
@@ -364,6 +494,8 @@ public:
       }
 
       left_sibling->hdr.sibling_ptr = hdr.sibling_ptr;
+      if (hdr.sibling_ptr)
+        hdr.sibling_ptr->hdr.prev_ptr = left_sibling;
     }
 
     return true;
@@ -378,12 +510,10 @@ public:
 
     if (*num_entries == 0)
     { // this page is empty
-      entry *new_entry = (entry *)&records[0];
-      entry *array_end = (entry *)&records[1];
-      new_entry->key = (entry_key_t)key;
-      new_entry->ptr = (char *)ptr;
+      records[0].key = (entry_key_t)key;
+      records[0].ptr = (char *)ptr;
 
-      array_end->ptr = (char *)nullptr;
+      records[1].ptr = (char *)nullptr;
     }
     else
     {
@@ -421,6 +551,46 @@ public:
     ++(*num_entries);
   }
 
+  // Inserts the longest prefix of the sorted keys that belongs to this leaf
+  // and fits in it. fence is the separator that bounds the leaf in its
+  // parent. Returns how many keys were inserted, 0 when the first key needs
+  // a split or belongs to a sibling.
+  size_t store_batch(const entry_key_t *keys, char *const *ptrs, size_t num,
+                     entry_key_t fence)
+  {
+    if (hdr.is_deleted)
+      return 0;
+
+    // store() hands the keys greater than this bound to the sibling
+    page *sibling = hdr.sibling_ptr;
+    entry_key_t bound = sibling ? sibling->records[0].key : LONG_MAX;
+
+    int num_entries = count();
+    size_t i = 0;
+    while (i < num && num_entries < cardinality - 1 && keys[i] < fence &&
+           (!sibling || keys[i] <= bound))
+    {
+      insert_key(keys[i], ptrs[i], &num_entries);
+      ++i;
+    }
+
+    return i;
+  }
+
+  // The smallest separator of this internal page above key, LONG_MAX if
+  // there is none. The first key of a leaf can be above the separator of the
+  // leaf once a delete removed it, so the keys between them would be routed
+  // to that leaf by the parent but stored in the leaf left of it by store().
+  entry_key_t upper_fence(entry_key_t key)
+  {
+    for (int i = 0; records[i].ptr != nullptr; ++i)
+    {
+      if (records[i].key > key)
+        return records[i].key;
+    }
+    return LONG_MAX;
+  }
+
   // Insert a new key
   page *store(btree *bt, char *left, entry_key_t key, char *right,
               page *invalid_sibling = nullptr)
@@ -467,10 +637,16 @@ public:
         }
         sibling->hdr.leftmost_ptr = (page *)records[m].ptr;
       }
+      // the sibling is not reachable yet, so count() can start from here
+      sibling->hdr.last_index = sibling_cnt - 1;
 
       sibling->hdr.sibling_ptr = hdr.sibling_ptr;
+      sibling->hdr.prev_ptr = this;
 
       hdr.sibling_ptr = sibling;
+      // the old right neighbour now follows the sibling
+      if (sibling->hdr.sibling_ptr)
+        sibling->hdr.sibling_ptr->hdr.prev_ptr = sibling;
 
       if (hdr.switch_counter % 2 == 0)
         hdr.switch_counter += 2;
@@ -513,110 +689,137 @@ public:
     }
   }
 
-  void linear_search_range(entry_key_t min, entry_key_t max,
-                           unsigned long *buf, int &off)
+  // Passes the slots of this page whose keys are within the bounds to
+  // emit(key, ptr), min and max themselves only if they are inclusive.
+  // Returns false once a key above max is seen.
+  template <typename Emit>
+  bool scan_range(entry_key_t min, entry_key_t max, bool min_inclusive,
+                  bool max_inclusive, Emit emit, uint8_t switch_counter)
   {
     int i;
-    uint8_t previous_switch_counter;
-    page *current = this;
-
-    while (current)
+    entry_key_t tmp_key;
+    char *tmp_ptr;
+    auto above_min = [&](entry_key_t k)
+    { return k > min || (min_inclusive && k == min); };
+    auto below_max = [&](entry_key_t k)
+    { return k < max || (max_inclusive && k == max); };
+
+    if (switch_counter % 2 == 0)
     {
-      int old_off = off;
-      do
-      {
-        previous_switch_counter = current->hdr.switch_counter;
-        off = old_off;
+      int start = 1;
+#ifdef RANK_SEARCH
+      // skip the keys below the bound
+      start = std::max(1, rank(min, count(), !min_inclusive));
+#endif
 
-        entry_key_t tmp_key;
-        char *tmp_ptr;
-
-        if (previous_switch_counter % 2 == 0)
+      if (above_min(tmp_key = records[0].key))
+      {
+        if (below_max(tmp_key))
         {
-          if ((tmp_key = current->records[0].key) > min)
+          if ((tmp_ptr = records[0].ptr) != nullptr)
           {
-            if (tmp_key < max)
+            if (tmp_key == records[0].key)
             {
-              if ((tmp_ptr = current->records[0].ptr) != nullptr)
+              if (tmp_ptr)
               {
-                if (tmp_key == current->records[0].key)
-                {
-                  if (tmp_ptr)
-                  {
-                    buf[off++] = (unsigned long)tmp_ptr;
-                  }
-                }
+                emit(tmp_key, tmp_ptr);
               }
             }
-            else
-              return;
           }
+        }
+        else
+          return false;
+      }
 
-          for (i = 1; current->records[i].ptr != nullptr; ++i)
+      for (i = start; records[i].ptr != nullptr; ++i)
+      {
+        if (above_min(tmp_key = records[i].key))
+        {
+          if (below_max(tmp_key))
           {
-            if ((tmp_key = current->records[i].key) > min)
+            if ((tmp_ptr = records[i].ptr) != records[i - 1].ptr)
             {
-              if (tmp_key < max)
+              if (tmp_key == records[i].key)
               {
-                if ((tmp_ptr = current->records[i].ptr) !=
-                    current->records[i - 1].ptr)
-                {
-                  if (tmp_key == current->records[i].key)
-                  {
-                    if (tmp_ptr)
-                      buf[off++] = (unsigned long)tmp_ptr;
-                  }
-                }
+                if (tmp_ptr)
+                  emit(tmp_key, tmp_ptr);
               }
-              else
-                return;
             }
           }
+          else
+            return false;
         }
-        else
+      }
+    }
+    else
+    {
+      // the keys come from the right, one above max does not end the page
+      bool more = true;
+      for (i = count() - 1; i > 0; --i)
+      {
+        if (above_min(tmp_key = records[i].key))
         {
-          for (i = count() - 1; i > 0; --i)
+          if (below_max(tmp_key))
           {
-            if ((tmp_key = current->records[i].key) > min)
+            if ((tmp_ptr = records[i].ptr) != records[i - 1].ptr)
             {
-              if (tmp_key < max)
+              if (tmp_key == records[i].key)
               {
-                if ((tmp_ptr = current->records[i].ptr) !=
-                    current->records[i - 1].ptr)
-                {
-                  if (tmp_key == current->records[i].key)
-                  {
-                    if (tmp_ptr)
-                      buf[off++] = (unsigned long)tmp_ptr;
-                  }
-                }
+                if (tmp_ptr)
+                  emit(tmp_key, tmp_ptr);
               }
-              else
-                return;
             }
           }
+          else
+            more = false;
+        }
+      }
 
-          if ((tmp_key = current->records[0].key) > min)
+      if (above_min(tmp_key = records[0].key))
+      {
+        if (below_max(tmp_key))
+        {
+          if ((tmp_ptr = records[0].ptr) != nullptr)
           {
-            if (tmp_key < max)
+            if (tmp_key == records[0].key)
             {
-              if ((tmp_ptr = current->records[0].ptr) != nullptr)
+              if (tmp_ptr)
               {
-                if (tmp_key == current->records[0].key)
-                {
-                  if (tmp_ptr)
-                  {
-                    buf[off++] = (unsigned long)tmp_ptr;
-                  }
-                }
+                emit(tmp_key, tmp_ptr);
               }
             }
-            else
-              return;
           }
         }
+        else
+          return false;
+      }
+      return more;
+    }
+    return true;
+  }
+
+  void linear_search_range(entry_key_t min, entry_key_t max,
+                           unsigned long *buf, int &off)
+  {
+    uint8_t previous_switch_counter;
+    page *current = this;
+
+    while (current)
+    {
+      int old_off = off;
+      bool more;
+      do
+      {
+        previous_switch_counter = current->hdr.switch_counter;
+        off = old_off;
+        more = current->scan_range(
+            min, max, false, false,
+            [&](entry_key_t, char *ptr) { buf[off++] = (unsigned long)ptr; },
+            previous_switch_counter);
       } while (previous_switch_counter != current->hdr.switch_counter);
 
+      if (!more)
+        return;
       current = current->hdr.sibling_ptr;
     }
   }
@@ -639,6 +842,23 @@ public:
         // search from left ro right
         if (previous_switch_counter % 2 == 0)
         {
+#ifdef RANK_SEARCH
+          int num_entries = count();
+          i = rank(key, num_entries, false);
+          if (i == num_entries || (k = records[i].key) != key)
+            continue; // not in this page
+
+          t = records[i].ptr;
+          if (t != nullptr && t != ((i == 0) ? nullptr : records[i - 1].ptr))
+          {
+            if (k == records[i].key)
+            {
+              ret = t;
+              continue;
+            }
+          }
+          // the slot is being shifted, fall back to the scan
+#endif
           if ((k = records[0].key) == key)
           {
             if ((t = records[0].ptr) != nullptr)
@@ -719,6 +939,17 @@ public:
 
         if (previous_switch_counter % 2 == 0)
         {
+#ifdef RANK_SEARCH
+          int num_entries = count();
+          i = rank(key, num_entries, true);
+          t = (i == 0) ? (char *)hdr.leftmost_ptr : records[i - 1].ptr;
+          if (i == num_entries || t != records[i].ptr)
+          {
+            ret = t;
+            continue;
+          }
+          // the slot is being shifted, fall back to the scan
+#endif
           if (key < (k = records[0].key))
           {
             if ((t = (char *)hdr.leftmost_ptr) != records[0].ptr)
@@ -809,6 +1040,13 @@ void btree::setNewRoot(char *new_root)
 char *btree::btree_search(entry_key_t key)
 {
   LOG(INFO) << "b plus tree started point search!" << endl;
+#ifdef BLOOM_FILTER
+  if (!filter.may_contain(key))
+  {
+    LOG(INFO) << "NOT FOUND " << key << endl;
+    return nullptr;
+  }
+#endif
   page *p = (page *)root;
 
   while (p->hdr.leftmost_ptr != nullptr)
@@ -828,13 +1066,68 @@ char *btree::btree_search(entry_key_t key)
 
   if (!t)
   {
-    printf("NOT FOUND %lu, t = %x\n", key, t);
+    LOG(INFO) << "NOT FOUND " << key << endl;
     return nullptr;
   }
 
   return (char *)t;
 }
 
+// Looks up keys[0..num) and stores the value of every key to results, or
+// nullptr if it is not in the tree. Groups of SEARCH_BATCH_GROUP keys descend
+// level by level: the child page of a key is prefetched when it is found and
+// only searched after the rest of the group, so the misses of the group
+// overlap instead of stalling every search once per level.
+void btree::btree_search_batch(const entry_key_t *keys, size_t num,
+                               char **results)
+{
+  LOG(INFO) << "b plus tree started batch point search!" << endl;
+  page *cur[SEARCH_BATCH_GROUP];
+  for (size_t base = 0; base < num; base += SEARCH_BATCH_GROUP)
+  {
+    int n = (int)std::min(num - base, (size_t)SEARCH_BATCH_GROUP);
+    const entry_key_t *k = keys + base;
+    for (int j = 0; j < n; j++)
+    {
+      cur[j] = (page *)root;
+#ifdef BLOOM_FILTER
+      if (!filter.may_contain(k[j]))
+        cur[j] = nullptr;
+#endif
+    }
+
+    // one round per level, a key that moved to a sibling stays on its level
+    bool descending = true;
+    while (descending)
+    {
+      descending = false;
+      for (int j = 0; j < n; j++)
+      {
+        if (cur[j] == nullptr || cur[j]->hdr.leftmost_ptr == nullptr)
+          continue;
+        cur[j] = (page *)cur[j]->linear_search(k[j]);
+        prefetch_page(cur[j]);
+        descending = true;
+      }
+    }
+
+    for (int j = 0; j < n; j++)
+    {
+      page *p = cur[j];
+      page *t = nullptr;
+      while (p && (t = (page *)p->linear_search(k[j])) == p->hdr.sibling_ptr)
+      {
+        p = t;
+        if (!p)
+        {
+          break;
+        }
+      }
+      results[base + j] = (char *)t;
+    }
+  }
+}
+
 // insert the key in the leaf node
 void btree::btree_insert(entry_key_t key, char *right)
 {
@@ -850,7 +1143,43 @@ void btree::btree_insert(entry_key_t key, char *right)
   {
     btree_insert(key, right);
   }
+#ifdef BLOOM_FILTER
+  else
+  {
+    filter_add(&key, 1);
+  }
+#endif
+}
+
+#ifdef BLOOM_FILTER
+// adds keys that were just stored in the leaves to the filter, a filter they
+// do not fit in is rebuilt twice as large from the leaves instead
+void btree::filter_add(const entry_key_t *keys, size_t num)
+{
+  if (filter.size() + num > filter.capacity())
+  {
+    filter_rebuild((filter.size() + num) * 2);
+    return;
+  }
+  for (size_t i = 0; i < num; i++)
+    filter.add(keys[i]);
+}
+
+// empties the filter, sizes it for capacity keys and adds the keys of all
+// the leaves
+void btree::filter_rebuild(size_t capacity)
+{
+  filter.reset(std::max(capacity, (size_t)1024));
+  page *p = (page *)root;
+  while (p->hdr.leftmost_ptr != nullptr)
+    p = p->hdr.leftmost_ptr;
+  for (; p; p = p->hdr.sibling_ptr)
+  {
+    for (int i = 0; p->records[i].ptr != nullptr; ++i)
+      filter.add(p->records[i].key);
+  }
 }
+#endif
 
 void btree::btree_insert_internal(char *left, entry_key_t key, char *right,
                                   uint32_t level)
@@ -872,6 +1201,13 @@ void btree::btree_insert_internal(char *left, entry_key_t key, char *right,
 void btree::btree_delete(entry_key_t key)
 {
   LOG(INFO) << "b plus tree delete the key!" << endl;
+#ifdef BLOOM_FILTER
+  if (!filter.may_contain(key))
+  {
+    printf("not found the key to delete %lu\n", key);
+    return;
+  }
+#endif
   page *p = (page *)root;
 
   while (p->hdr.leftmost_ptr != nullptr)
@@ -889,6 +1225,10 @@ void btree::btree_delete(entry_key_t key)
 
   if (p)
   {
+#ifdef BLOOM_FILTER
+    if (t)
+      filter.remove(key);
+#endif
     if (!p->remove(this, key))
     {
       btree_delete(key);
@@ -972,3 +1312,454 @@ void btree::btree_search_range(entry_key_t min, entry_key_t max,
     }
   }
 }
+
+// Calls visit(key, ptr) for the entries with min < key < max, in key order,
+// until visit returns false. min_inclusive and max_inclusive also take in
+// the entries equal to the bounds. The entries of one leaf at a time are
+// copied to the stack, so the scan runs in constant memory.
+template <typename Visitor>
+void btree::btree_scan(entry_key_t min, entry_key_t max, bool min_inclusive,
+                       bool max_inclusive, Visitor visit)
+{
+  btree_scan_where(min, max, min_inclusive, max_inclusive, accept_all(),
+                   visit);
+}
+
+// btree_scan that only passes the entries for which where(key, ptr) holds.
+// The predicate runs inside the leaf scan, while the slots are read, so the
+// rows it rejects are never copied out.
+template <typename Predicate, typename Visitor>
+void btree::btree_scan_where(entry_key_t min, entry_key_t max,
+                             bool min_inclusive, bool max_inclusive,
+                             Predicate where, Visitor visit)
+{
+  LOG(INFO) << "b plus tree started range scan!" << endl;
+  // equal keys can be on both sides of a split, so an inclusive scan starts
+  // from the leaf of the keys below min
+  entry_key_t descend = (min_inclusive && min > LLONG_MIN) ? min - 1 : min;
+  page *p = (page *)root;
+  while (p->hdr.leftmost_ptr != nullptr)
+  {
+    p = (page *)p->linear_search(descend);
+  }
+
+  entry_key_t keys[cardinality];
+  char *ptrs[cardinality];
+  while (p)
+  {
+    uint8_t switch_counter = p->hdr.switch_counter;
+    int n = 0;
+    bool more = p->scan_range(
+        min, max, min_inclusive, max_inclusive,
+        [&](entry_key_t k, char *ptr)
+        {
+          if (where(k, ptr))
+          {
+            keys[n] = k;
+            ptrs[n++] = ptr;
+          }
+        },
+        switch_counter);
+
+    // a page scanned from the right gave its keys in descending order
+    bool descending = switch_counter % 2 != 0;
+    for (int i = 0; i < n; i++)
+    {
+      int j = descending ? n - 1 - i : i;
+      if (!visit(keys[j], ptrs[j]))
+        return;
+    }
+
+    if (!more)
+      return;
+    p = p->hdr.sibling_ptr;
+  }
+}
+
+// Calls visit(key, ptr) for the entries between the bounds like btree_scan,
+// but in descending key order. The scan starts from the leaf of max and
+// moves left along prev_ptr.
+template <typename Visitor>
+void btree::btree_scan_reverse(entry_key_t min, entry_key_t max,
+                               bool min_inclusive, bool max_inclusive,
+                               Visitor visit)
+{
+  LOG(INFO) << "b plus tree started reverse range scan!" << endl;
+  page *p = (page *)root;
+  while (p->hdr.leftmost_ptr != nullptr)
+  {
+    p = (page *)p->linear_search(max);
+  }
+  // equal keys can be on both sides of a split, start from the last leaf
+  page *t;
+  while ((t = p->hdr.sibling_ptr) != nullptr &&
+         (t->records[0].key < max ||
+          (max_inclusive && t->records[0].key == max)))
+  {
+    p = t;
+  }
+
+  entry_key_t keys[cardinality];
+  char *ptrs[cardinality];
+  while (p)
+  {
+    uint8_t switch_counter = p->hdr.switch_counter;
+    int n = 0;
+    p->scan_range(
+        min, max, min_inclusive, max_inclusive,
+        [&](entry_key_t k, char *ptr)
+        {
+          keys[n] = k;
+          ptrs[n++] = ptr;
+        },
+        switch_counter);
+    // the keys left of this page are below its first key
+    bool more = p->records[0].ptr == nullptr || p->records[0].key > min ||
+                (min_inclusive && p->records[0].key == min);
+
+    // a page scanned from the left gave its keys in ascending order
+    bool ascending = switch_counter % 2 == 0;
+    for (int i = 0; i < n; i++)
+    {
+      int j = ascending ? n - 1 - i : i;
+      if (!visit(keys[j], ptrs[j]))
+        return;
+    }
+
+    if (!more)
+      return;
+    p = p->hdr.prev_ptr;
+  }
+}
+
+// Sorts the (key, ptr) pairs into sorted_keys and sorted_ptrs. The position
+// breaks ties, so equal keys keep their input order like with btree_insert.
+static void sort_pairs(const entry_key_t *keys, char *const *ptrs, size_t num,
+                       vector<entry_key_t> &sorted_keys,
+                       vector<char *> &sorted_ptrs)
+{
+  vector<pair<entry_key_t, size_t>> order(num);
+  for (size_t i = 0; i < num; i++)
+    order[i] = make_pair(keys[i], i);
+  std::sort(order.begin(), order.end());
+
+  sorted_keys.resize(num);
+  sorted_ptrs.resize(num);
+  for (size_t i = 0; i < num; i++)
+  {
+    sorted_keys[i] = order[i].first;
+    sorted_ptrs[i] = ptrs[order[i].second];
+  }
+}
+
+// number of entries of a bulk loaded page, between 1 and cardinality - 1
+static inline int bulk_fill(double fill_factor)
+{
+  int num_entries = (int)((cardinality - 1) * fill_factor);
+  return std::min(std::max(num_entries, 1), cardinality - 1);
+}
+
+// a leaf holding the sorted entries [begin, end)
+page *btree::bulk_leaf(const entry_key_t *keys, char *const *ptrs,
+                       size_t begin, size_t end)
+{
+  page *leaf = new page(0);
+  int num_entries = 0;
+  for (size_t i = begin; i < end; i++)
+    leaf->insert_key(keys[i], ptrs[i], &num_entries);
+  return leaf;
+}
+
+// Builds the internal levels on top of the linked pages of one level, whose
+// smallest keys are in low_keys, and makes the top page the root.
+void btree::bulk_build_levels(vector<page *> &pages,
+                              vector<entry_key_t> &low_keys,
+                              double fill_factor)
+{
+  uint32_t level = 0;
+  size_t fanout = std::max(bulk_fill(fill_factor) + 1, 3);
+
+  while (pages.size() > 1)
+  {
+    ++level;
+    size_t num_parents = (pages.size() + fanout - 1) / fanout;
+    vector<page *> parents(num_parents);
+    vector<entry_key_t> parent_keys(num_parents);
+
+    for (size_t i = 0; i < num_parents; i++)
+    {
+      // spread the children evenly, so every parent gets at least two
+      size_t begin = pages.size() * i / num_parents;
+      size_t end = pages.size() * (i + 1) / num_parents;
+
+      page *parent = new page(level);
+      parent->hdr.leftmost_ptr = pages[begin];
+      int num_entries = 0;
+      for (size_t c = begin + 1; c < end; c++)
+        parent->insert_key(low_keys[c], (char *)pages[c], &num_entries);
+
+      if (i > 0)
+      {
+        parents[i - 1]->hdr.sibling_ptr = parent;
+        parent->hdr.prev_ptr = parents[i - 1];
+      }
+      parents[i] = parent;
+      parent_keys[i] = low_keys[begin];
+    }
+
+    pages.swap(parents);
+    low_keys.swap(parent_keys);
+  }
+
+  delete (page *)root;
+  root = (char *)pages[0];
+  height = level + 1;
+}
+
+// Builds the tree bottom-up from (key, ptr) pairs: the leaves are packed
+// to fill_factor of their capacity and linked, then the internal levels
+// are built over them. The pairs are sorted first unless the keys already
+// are. A tree that is not empty gets the pairs through btree_insert.
+void btree::btree_bulk_load(const entry_key_t *keys, char *const *ptrs,
+                            size_t num, double fill_factor)
+{
+  LOG(INFO) << "b plus tree bulk load!" << endl;
+  page *p = (page *)root;
+
+  if (p->hdr.leftmost_ptr != nullptr || p->count() > 0)
+  {
+    for (size_t i = 0; i < num; i++)
+      btree_insert(keys[i], ptrs[i]);
+    return;
+  }
+
+  if (num == 0)
+    return;
+
+  vector<entry_key_t> sorted_keys;
+  vector<char *> sorted_ptrs;
+  if (!std::is_sorted(keys, keys + num))
+  {
+    sort_pairs(keys, ptrs, num, sorted_keys, sorted_ptrs);
+    keys = sorted_keys.data();
+    ptrs = sorted_ptrs.data();
+  }
+
+  size_t per_leaf = bulk_fill(fill_factor);
+  size_t num_leaves = (num + per_leaf - 1) / per_leaf;
+  vector<page *> leaves(num_leaves);
+  vector<entry_key_t> low_keys(num_leaves);
+
+  for (size_t i = 0; i < num_leaves; i++)
+  {
+    size_t begin = num * i / num_leaves;
+    leaves[i] = bulk_leaf(keys, ptrs, begin, num * (i + 1) / num_leaves);
+    low_keys[i] = keys[begin];
+    if (i > 0)
+    {
+      leaves[i - 1]->hdr.sibling_ptr = leaves[i];
+      leaves[i]->hdr.prev_ptr = leaves[i - 1];
+    }
+  }
+
+  bulk_build_levels(leaves, low_keys, fill_factor);
+#ifdef BLOOM_FILTER
+  filter_rebuild(num * 2);
+#endif
+}
+
+// Inserts a batch of (key, ptr) pairs. The batch is sorted, and every run of
+// keys that lands in the same leaf is inserted with one traversal. A key
+// that needs a split goes through store().
+void btree::btree_insert_batch(const entry_key_t *keys,
+                               char *const *ptrs, size_t num)
+{
+  LOG(INFO) << "b plus tree batch insert!" << endl;
+  vector<entry_key_t> sorted_keys;
+  vector<char *> sorted_ptrs;
+  if (!std::is_sorted(keys, keys + num))
+  {
+    sort_pairs(keys, ptrs, num, sorted_keys, sorted_ptrs);
+    keys = sorted_keys.data();
+    ptrs = sorted_ptrs.data();
+  }
+
+  size_t i = 0;
+  while (i < num)
+  {
+    page *p = (page *)root;
+    entry_key_t fence = LONG_MAX;
+    while (p->hdr.leftmost_ptr != nullptr)
+    {
+      fence = std::min(fence, p->upper_fence(keys[i]));
+      p = (page *)p->linear_search(keys[i]);
+    }
+
+    size_t inserted = p->store_batch(keys + i, ptrs + i, num - i, fence);
+    if (inserted == 0)
+    {
+      if (!p->store(this, nullptr, keys[i], ptrs[i]))
+        btree_insert(keys[i], ptrs[i]);
+#ifdef BLOOM_FILTER
+      else
+        filter_add(keys + i, 1);
+#endif
+      inserted = 1;
+    }
+#ifdef BLOOM_FILTER
+    else
+    {
+      filter_add(keys + i, inserted);
+    }
+#endif
+    i += inserted;
+  }
+}
+
+// runs fn(0), ..., fn(num_threads - 1) each on its own thread
+template <typename F> static void run_threads(int num_threads, F fn)
+{
+  vector<std::thread> vthreads;
+  for (int t = 0; t < num_threads; t++)
+    vthreads.push_back(std::thread(fn, t));
+  for (auto &u : vthreads)
+    u.join();
+}
+
+// Sorts the (key, position) pairs on num_threads threads: every thread sorts
+// one chunk, splitters sampled from the sorted chunks cut the key space into
+// one range per thread, and every thread merges its range out of all chunks.
+static void parallel_sort(vector<pair<entry_key_t, size_t>> &pairs,
+                          int num_threads)
+{
+  typedef pair<entry_key_t, size_t> key_pos;
+  size_t num = pairs.size();
+  size_t T = num_threads;
+
+  run_threads(num_threads, [&](int t) {
+    std::sort(pairs.begin() + num * t / T, pairs.begin() + num * (t + 1) / T);
+  });
+
+  // T - 1 splitters out of T samples of every chunk
+  vector<key_pos> samples;
+  for (size_t c = 0; c < T; c++)
+  {
+    size_t begin = num * c / T, end = num * (c + 1) / T;
+    for (size_t i = 0; i < T && begin < end; i++)
+      samples.push_back(pairs[begin + (end - begin) * i / T]);
+  }
+  std::sort(samples.begin(), samples.end());
+  vector<key_pos> splitters;
+  for (size_t i = 1; i < T; i++)
+    splitters.push_back(samples[samples.size() * i / T]);
+
+  // cut[c][j]: where the range of thread j starts in chunk c
+  vector<vector<size_t>> cut(T, vector<size_t>(T + 1));
+  vector<size_t> out_begin(T + 1, 0);
+  for (size_t c = 0; c < T; c++)
+  {
+    auto begin = pairs.begin() + num * c / T;
+    auto end = pairs.begin() + num * (c + 1) / T;
+    cut[c][0] = begin - pairs.begin();
+    for (size_t j = 1; j < T; j++)
+      cut[c][j] = std::lower_bound(begin, end, splitters[j - 1]) - pairs.begin();
+    cut[c][T] = end - pairs.begin();
+    for (size_t j = 0; j < T; j++)
+      out_begin[j + 1] += cut[c][j + 1] - cut[c][j];
+  }
+  for (size_t j = 0; j < T; j++)
+    out_begin[j + 1] += out_begin[j];
+
+  vector<key_pos> sorted(num);
+  run_threads(num_threads, [&](int j) {
+    auto out = sorted.begin() + out_begin[j];
+    for (size_t c = 0; c < T; c++)
+    {
+      auto mid = out;
+      out = std::copy(pairs.begin() + cut[c][j], pairs.begin() + cut[c][j + 1],
+                      out);
+      std::inplace_merge(sorted.begin() + out_begin[j], mid, out);
+    }
+  });
+  pairs.swap(sorted);
+}
+
+// Same as btree_bulk_load with every step but the internal levels split over
+// num_threads threads: the sort of the pairs, and the leaves, each thread
+// building a disjoint run of them.
+void btree::btree_bulk_load_parallel(const entry_key_t *keys,
+                                     char *const *ptrs, size_t num,
+                                     int num_threads, double fill_factor)
+{
+  LOG(INFO) << "b plus tree parallel bulk load!" << endl;
+  page *p = (page *)root;
+
+  if (num_threads <= 1 || num < (size_t)num_threads * cardinality ||
+      p->hdr.leftmost_ptr != nullptr || p->count() > 0)
+  {
+    btree_bulk_load(keys, ptrs, num, fill_factor);
+    return;
+  }
+
+  size_t T = num_threads;
+  vector<entry_key_t> sorted_keys;
+  vector<char *> sorted_ptrs;
+  if (!std::is_sorted(keys, keys + num))
+  {
+    vector<pair<entry_key_t, size_t>> order(num);
+    run_threads(num_threads, [&](int t) {
+      for (size_t i = num * t / T; i < num * (t + 1) / T; i++)
+        order[i] = make_pair(keys[i], i);
+    });
+    parallel_sort(order, num_threads);
+
+    sorted_keys.resize(num);
+    sorted_ptrs.resize(num);
+    run_threads(num_threads, [&](int t) {
+      for (size_t i = num * t / T; i < num * (t + 1) / T; i++)
+      {
+        sorted_keys[i] = order[i].first;
+        sorted_ptrs[i] = ptrs[order[i].second];
+      }
+    });
+    keys = sorted_keys.data();
+    ptrs = sorted_ptrs.data();
+  }
+
+  size_t per_leaf = bulk_fill(fill_factor);
+  size_t num_leaves = (num + per_leaf - 1) / per_leaf;
+  vector<page *> leaves(num_leaves);
+  vector<entry_key_t> low_keys(num_leaves);
+
+  run_threads(num_threads, [&](int t) {
+    size_t first = num_leaves * t / T, last = num_leaves * (t + 1) / T;
+    for (size_t i = first; i < last; i++)
+    {
+      size_t begin = num * i / num_leaves;
+      leaves[i] = bulk_leaf(keys, ptrs, begin, num * (i + 1) / num_leaves);
+      low_keys[i] = keys[begin];
+      if (i > first)
+      {
+        leaves[i - 1]->hdr.sibling_ptr = leaves[i];
+        leaves[i]->hdr.prev_ptr = leaves[i - 1];
+      }
+    }
+  });
+  // link the runs of the threads
+  for (size_t t = 1; t < T; t++)
+  {
+    size_t first = num_leaves * t / T;
+    if (first > 0 && first < num_leaves)
+    {
+      leaves[first - 1]->hdr.sibling_ptr = leaves[first];
+      leaves[first]->hdr.prev_ptr = leaves[first - 1];
+    }
+  }
+
+  bulk_build_levels(leaves, low_keys, fill_factor);
+#ifdef BLOOM_FILTER
+  filter_rebuild(num * 2);
+#endif
+}
+
+#endif
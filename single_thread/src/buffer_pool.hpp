@@ -0,0 +1,571 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <list>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include <glog/logging.h>
+#include "page_io.hpp"
+
+#ifndef DISK_PAGESIZE
+#define DISK_PAGESIZE 4096
+#endif
+
+typedef uint64_t page_id;
+// page 0 of a file holds its metadata, so no tree page links to it
+const page_id invalid_page = 0;
+
+/*
+ * A file of DISK_PAGESIZE pages, page i at offset i * DISK_PAGESIZE. Pages
+ * are only appended, allocate hands out the page after the last one.
+ */
+class page_file
+{
+private:
+  int fd;
+  uint64_t num_pages_;
+
+public:
+  page_file() : fd(-1), num_pages_(0) {}
+  ~page_file() { close(); }
+
+  page_file(const page_file &) = delete;
+  page_file &operator=(const page_file &) = delete;
+
+  // opens the file at path, creating it if it does not exist
+  bool open(const char *path, std::string &error)
+  {
+    close();
+    fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+      error = std::string("cannot open ") + path + ": " + strerror(errno);
+      close();
+      return false;
+    }
+    num_pages_ = (st.st_size + DISK_PAGESIZE - 1) / DISK_PAGESIZE;
+    return true;
+  }
+
+  void close()
+  {
+    if (fd >= 0)
+      ::close(fd);
+    fd = -1;
+  }
+
+  bool is_open() const { return fd >= 0; }
+  int descriptor() const { return fd; }
+  uint64_t num_pages() const { return num_pages_; }
+  page_id allocate() { return num_pages_++; }
+
+  // a page past the end of the file reads as zeros
+  bool read(page_id id, void *buf)
+  {
+    ssize_t n = pread(fd, buf, DISK_PAGESIZE, (off_t)id * DISK_PAGESIZE);
+    if (n < 0)
+      return false;
+    memset((char *)buf + n, 0, DISK_PAGESIZE - n);
+    return true;
+  }
+
+  bool write(page_id id, const void *buf)
+  {
+    return pwrite(fd, buf, DISK_PAGESIZE, (off_t)id * DISK_PAGESIZE) ==
+           DISK_PAGESIZE;
+  }
+
+  bool sync() { return fsync(fd) == 0; }
+};
+
+struct buffer_stats
+{
+  uint64_t hits;
+  uint64_t misses;    // pins that read the page from the file
+  uint64_t writes;    // dirty pages written back
+  uint64_t evictions; // frames given to another page
+  uint64_t prefetches; // pages read ahead
+
+  double hit_rate() const { return hits / (double)(hits + misses); }
+};
+
+// how the buffer pool picks the page to evict
+enum replacement_policy
+{
+  REPLACE_CLOCK, // second chance, one reference bit per frame
+  REPLACE_2Q     // Johnson and Shasha's 2Q, scan resistant
+};
+
+/*
+ * A fixed number of page frames over a page_file. pin returns the frame of
+ * a page, reading it on a miss, and the frame stays there until it is
+ * unpinned as often as it was pinned. A page that is not pinned can be
+ * evicted to make room, dirty pages are written back when they are evicted
+ * or flushed.
+ *
+ * With REPLACE_CLOCK a hand sweeps the frames, clearing their reference
+ * bits, and takes the first unpinned one whose bit is clear. A scan that
+ * touches every leaf once sets the bits of all of them and pushes out the
+ * internal pages the lookups need.
+ *
+ * REPLACE_2Q keeps the pages read once in a FIFO, a1in, and only moves a
+ * page to the LRU list of hot pages, am, when it is read again after it
+ * left a1in, which a1out remembers for a while. A scan therefore only
+ * cycles through a1in. A pin with the sequential hint goes further: its
+ * page is the next one evicted and never counts as a second reference.
+ *
+ * With an asynchronous io_backend, prefetch reads pages in the background
+ * for a scan, and flush writes all the dirty pages in one batch. A page
+ * being read is pinned until its read completes.
+ */
+class buffer_pool
+{
+private:
+  enum queue_id
+  {
+    QUEUE_NONE,
+    QUEUE_A1IN,
+    QUEUE_AM
+  };
+
+  struct frame
+  {
+    page_id id; // invalid_page when the frame is free
+    uint32_t pin_count;
+    bool dirty;
+    bool referenced; // CLOCK
+    bool sequential; // read by a scan, 2Q
+    bool loading;    // read by prefetch, not complete yet
+    bool prefetched; // read by prefetch, not pinned since
+    queue_id queue;  // 2Q
+    size_t prev, next;
+  };
+
+  // a doubly linked list of frames, the most recent at the head
+  struct frame_queue
+  {
+    size_t head, tail, size;
+  };
+
+  static const size_t none = SIZE_MAX;
+  static const uint64_t write_tag = 1ULL << 63; // tags are frames, or'ed
+
+  page_file &file;
+  replacement_policy policy;
+  char *data; // the frames, DISK_PAGESIZE bytes each
+  std::vector<frame> frames;
+  std::unordered_map<page_id, size_t> page_table; // page -> frame
+  size_t hand;                                    // CLOCK
+  std::vector<size_t> free_frames;                // 2Q
+  frame_queue a1in, am;                           // 2Q
+  std::list<page_id> a1out; // 2Q, pages evicted from a1in, the newest first
+  std::unordered_map<page_id, std::list<page_id>::iterator> a1out_table;
+  size_t a1in_target, a1out_size;
+  page_io io;
+  bool write_failed;
+  buffer_stats stats_;
+
+  size_t frame_of(const char *page) const
+  {
+    return (page - data) / DISK_PAGESIZE;
+  }
+
+  frame_queue &queue(queue_id q) { return q == QUEUE_A1IN ? a1in : am; }
+
+  void push_front(queue_id q, size_t f)
+  {
+    frame_queue &l = queue(q);
+    frames[f].queue = q;
+    frames[f].prev = none;
+    frames[f].next = l.head;
+    if (l.head != none)
+      frames[l.head].prev = f;
+    else
+      l.tail = f;
+    l.head = f;
+    l.size++;
+  }
+
+  void push_back(queue_id q, size_t f)
+  {
+    frame_queue &l = queue(q);
+    frames[f].queue = q;
+    frames[f].next = none;
+    frames[f].prev = l.tail;
+    if (l.tail != none)
+      frames[l.tail].next = f;
+    else
+      l.head = f;
+    l.tail = f;
+    l.size++;
+  }
+
+  void unlink(size_t f)
+  {
+    frame_queue &l = queue(frames[f].queue);
+    frame &fr = frames[f];
+    (fr.prev != none ? frames[fr.prev].next : l.head) = fr.next;
+    (fr.next != none ? frames[fr.next].prev : l.tail) = fr.prev;
+    fr.queue = QUEUE_NONE;
+    l.size--;
+  }
+
+  // the oldest unpinned frame of q, or none
+  size_t oldest_unpinned(queue_id q)
+  {
+    for (size_t f = queue(q).tail; f != none; f = frames[f].prev)
+    {
+      if (frames[f].pin_count == 0)
+        return f;
+    }
+    return none;
+  }
+
+  void remember_evicted(page_id id)
+  {
+    a1out.push_front(id);
+    a1out_table[id] = a1out.begin();
+    if (a1out.size() > a1out_size)
+    {
+      a1out_table.erase(a1out.back());
+      a1out.pop_back();
+    }
+  }
+
+  bool write_back(size_t f)
+  {
+    if (frames[f].dirty)
+    {
+      if (!file.write(frames[f].id, data + f * DISK_PAGESIZE))
+        return false;
+      frames[f].dirty = false;
+      stats_.writes++;
+    }
+    return true;
+  }
+
+  void evict(size_t f)
+  {
+    frame &fr = frames[f];
+    if (!write_back(f))
+      LOG(FATAL) << "cannot write page " << fr.id << ": " << strerror(errno);
+    page_table.erase(fr.id);
+    stats_.evictions++;
+  }
+
+  size_t clock_victim()
+  {
+    // two turns clear every reference bit, after that only pins stop it
+    for (size_t step = 0; step < 2 * frames.size() + 1; step++)
+    {
+      size_t f = hand;
+      hand = (hand + 1) % frames.size();
+      frame &fr = frames[f];
+      if (fr.pin_count > 0)
+        continue;
+      if (fr.referenced)
+      {
+        fr.referenced = false;
+        continue;
+      }
+      if (fr.id != invalid_page)
+        evict(f);
+      return f;
+    }
+    return none;
+  }
+
+  size_t two_queue_victim()
+  {
+    if (!free_frames.empty())
+    {
+      size_t f = free_frames.back();
+      free_frames.pop_back();
+      return f;
+    }
+    // a1in gives up its oldest page once it is over its share, or at once
+    // when that page was only read by a scan
+    size_t f = oldest_unpinned(QUEUE_A1IN);
+    bool from_a1in = f != none && (a1in.size > a1in_target ||
+                                   (frames[f].sequential && !frames[f].prefetched));
+    if (!from_a1in)
+    {
+      size_t g = oldest_unpinned(QUEUE_AM);
+      if (g != none)
+        f = g;
+      from_a1in = g == none;
+    }
+    if (f == none)
+      return none;
+    evict(f);
+    if (from_a1in && !frames[f].sequential)
+      remember_evicted(frames[f].id);
+    unlink(f);
+    return f;
+  }
+
+  // a frame for page id, writing back the page it held, or none if all
+  // the frames are pinned
+  size_t take_frame(page_id id)
+  {
+    size_t f = policy == REPLACE_CLOCK ? clock_victim() : two_queue_victim();
+    if (f != none)
+    {
+      frames[f].id = id;
+      frames[f].prefetched = false;
+      page_table[id] = f;
+    }
+    return f;
+  }
+
+  size_t victim(page_id id)
+  {
+    size_t f = take_frame(id);
+    if (f == none)
+      LOG(FATAL) << "all " << frames.size() << " buffer frames are pinned";
+    return f;
+  }
+
+  // handles a finished request of io
+  void complete(const io_completion &c)
+  {
+    size_t f = c.tag & ~write_tag;
+    frame &fr = frames[f];
+    if (c.tag & write_tag)
+    {
+      if (c.result != DISK_PAGESIZE)
+      {
+        fr.dirty = true;
+        write_failed = true;
+      }
+      else
+        stats_.writes++;
+      return;
+    }
+    if (c.result < 0)
+      LOG(FATAL) << "cannot read page " << fr.id << ": " << strerror(-c.result);
+    // a page past the end of the file reads as zeros
+    memset(data + f * DISK_PAGESIZE + c.result, 0, DISK_PAGESIZE - c.result);
+    fr.loading = false;
+    fr.pin_count--;
+  }
+
+  // handles the requests that completed, waiting for the read of frame f
+  void poll(size_t f = none)
+  {
+    io_completion c;
+    while (io.next(&c, f != none && frames[f].loading))
+      complete(c);
+  }
+
+  // queues the frame of a page that was not buffered
+  void admit(size_t f, bool sequential)
+  {
+    frame &fr = frames[f];
+    fr.referenced = !sequential;
+    fr.sequential = sequential;
+    if (policy != REPLACE_2Q)
+      return;
+    auto it = a1out_table.find(fr.id);
+    if (it != a1out_table.end() && !sequential)
+    {
+      // read again since it left a1in, the page is hot
+      a1out.erase(it->second);
+      a1out_table.erase(it);
+      push_front(QUEUE_AM, f);
+    }
+    else if (sequential)
+      push_back(QUEUE_A1IN, f);
+    else
+      push_front(QUEUE_A1IN, f);
+  }
+
+public:
+  buffer_pool(page_file &file, size_t num_frames,
+              replacement_policy policy = REPLACE_2Q,
+              io_backend backend = IO_SYNC)
+      : file(file), policy(policy), frames(num_frames), hand(0),
+        a1in{none, none, 0}, am{none, none, 0},
+        a1in_target(std::max(num_frames / 4, (size_t)1)),
+        a1out_size(num_frames / 2), write_failed(false)
+  {
+    void *p;
+    posix_memalign(&p, DISK_PAGESIZE, num_frames * DISK_PAGESIZE);
+    data = (char *)p;
+    for (size_t f = 0; f < num_frames; f++)
+    {
+      frames[f] = frame{invalid_page, 0, false, false, false, false, false,
+                        QUEUE_NONE, none, none};
+      free_frames.push_back(num_frames - 1 - f);
+    }
+    if (backend != IO_SYNC)
+      io.start(file.descriptor(), backend);
+    memset(&stats_, 0, sizeof(stats_));
+  }
+
+  // the dirty pages are lost unless flush was called
+  ~buffer_pool()
+  {
+    io.stop();
+    free(data);
+  }
+
+  buffer_pool(const buffer_pool &) = delete;
+  buffer_pool &operator=(const buffer_pool &) = delete;
+
+  // The frame of page id, read from the file if it is not buffered.
+  // sequential tells that the page is read once by a scan.
+  char *pin(page_id id, bool sequential = false)
+  {
+    if (io.pending() > 0)
+      poll();
+    auto it = page_table.find(id);
+    size_t f;
+    if (it != page_table.end())
+    {
+      f = it->second;
+      frame &fr = frames[f];
+      stats_.hits++;
+      if (fr.loading)
+        poll(f);
+      if (fr.prefetched)
+      {
+        // the scan it was read for got there, it is an ordinary page now
+        fr.prefetched = false;
+        if (sequential && policy == REPLACE_2Q)
+        {
+          unlink(f);
+          push_back(QUEUE_A1IN, f);
+        }
+        fr.referenced = !sequential;
+        fr.sequential = sequential;
+      }
+      else if (!sequential)
+      {
+        fr.referenced = true;
+        fr.sequential = false;
+        // pages of a1in stay there, their second reference is usually part
+        // of the same operation
+        if (fr.queue == QUEUE_AM)
+        {
+          unlink(f);
+          push_front(QUEUE_AM, f);
+        }
+      }
+    }
+    else
+    {
+      f = victim(id);
+      if (!file.read(id, data + f * DISK_PAGESIZE))
+        LOG(FATAL) << "cannot read page " << id << ": " << strerror(errno);
+      stats_.misses++;
+      admit(f, sequential);
+    }
+    frames[f].pin_count++;
+    return data + f * DISK_PAGESIZE;
+  }
+
+  // Starts reading the pages of ids that are not buffered, in one batch.
+  // Does nothing without an asynchronous io_backend. A page stays queued
+  // like a new one until it is pinned, then it is a page of a scan.
+  void prefetch(const page_id *ids, size_t n)
+  {
+    if (!io.async())
+      return;
+    size_t issued = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+      if (page_table.count(ids[i]))
+        continue;
+      size_t f = take_frame(ids[i]);
+      if (f == none)
+        break;
+      frame &fr = frames[f];
+      fr.pin_count = 1;
+      fr.loading = true;
+      admit(f, false);
+      fr.prefetched = true;
+      fr.sequential = true;
+      io.read(data + f * DISK_PAGESIZE, DISK_PAGESIZE,
+              (off_t)ids[i] * DISK_PAGESIZE, f);
+      issued++;
+    }
+    if (issued > 0)
+      io.submit();
+    stats_.prefetches += issued;
+  }
+
+  // allocates a page at the end of the file and pins its zeroed frame
+  char *pin_new(page_id *id)
+  {
+    *id = file.allocate();
+    size_t f = victim(*id);
+    memset(data + f * DISK_PAGESIZE, 0, DISK_PAGESIZE);
+    frames[f].pin_count = 1;
+    frames[f].dirty = true;
+    admit(f, false);
+    return data + f * DISK_PAGESIZE;
+  }
+
+  // releases a frame returned by pin, dirty if the page was modified
+  void unpin(const char *page, bool dirty)
+  {
+    frame &fr = frames[frame_of(page)];
+    fr.pin_count--;
+    fr.dirty |= dirty;
+  }
+
+  // writes back all the dirty pages and syncs the file
+  bool flush()
+  {
+    if (!io.async())
+    {
+      for (size_t f = 0; f < frames.size(); f++)
+      {
+        if (frames[f].id != invalid_page && !write_back(f))
+          return false;
+      }
+      return file.sync();
+    }
+
+    // one batch of writes in file order
+    std::vector<std::pair<page_id, size_t>> dirty;
+    for (size_t f = 0; f < frames.size(); f++)
+    {
+      if (frames[f].id != invalid_page && frames[f].dirty)
+        dirty.push_back(std::make_pair(frames[f].id, f));
+    }
+    std::sort(dirty.begin(), dirty.end());
+    write_failed = false;
+    for (auto &d : dirty)
+    {
+      frames[d.second].dirty = false;
+      io.write(data + d.second * DISK_PAGESIZE, DISK_PAGESIZE,
+               (off_t)d.first * DISK_PAGESIZE, d.second | write_tag);
+    }
+    io.submit();
+    io_completion c;
+    while (io.next(&c, true))
+      complete(c);
+    return !write_failed && file.sync();
+  }
+
+  size_t num_frames() const { return frames.size(); }
+  bool async() const { return io.async(); }
+  io_backend backend() const { return io.backend(); }
+  replacement_policy replacement() const { return policy; }
+  const buffer_stats &stats() const { return stats_; }
+  void reset_stats() { memset(&stats_, 0, sizeof(stats_)); }
+};
+
+#endif
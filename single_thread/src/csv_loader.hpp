@@ -0,0 +1,235 @@
+#ifndef CSV_LOADER_HPP
+#define CSV_LOADER_HPP
+
+#include "row.hpp"
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Parallel loader of "a,b" CSV files like the input.txt of generateData.
+ * The mapped file is cut into one chunk per thread at line boundaries.
+ * Every thread counts the rows of its chunk, so each one knows where its
+ * rows start in the table, then parses them straight into it. Numbers are
+ * parsed 8 digits at a time with SWAR arithmetic on a 64-bit word.
+ */
+
+struct csv_stats
+{
+  size_t rows;
+  size_t bytes;
+  double seconds;
+
+  double rows_per_sec() const { return rows / seconds; }
+  double mb_per_sec() const { return bytes / seconds / 1e6; }
+};
+
+// Number of leading digits of the 8 bytes of chunk, the first byte lowest.
+static inline int swar_digits(uint64_t chunk)
+{
+  // a digit byte is 0x30..0x39: the high nibble of the byte and of the byte
+  // plus 6 are both 3. A carry out of a non digit byte only disturbs the
+  // bytes after it.
+  const uint64_t high = 0xF0F0F0F0F0F0F0F0ULL;
+  const uint64_t threes = 0x3030303030303030ULL;
+  uint64_t bad = ((chunk & high) ^ threes) |
+                 (((chunk + 0x0606060606060606ULL) & high) ^ threes);
+  return bad == 0 ? 8 : __builtin_ctzll(bad) / 8;
+}
+
+// The value of the first n (1 to 8) digits of chunk.
+static inline uint32_t swar_value(uint64_t chunk, int n)
+{
+  // the digits end up in the high bytes, after n - 8 leading zeros
+  uint64_t v = (chunk - 0x3030303030303030ULL) << (8 * (8 - n));
+  v = v * 10 + (v >> 8);
+  v = ((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)) +
+       ((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32))) >>
+      32;
+  return (uint32_t)v;
+}
+
+// Parses an int at p, before end. Returns the byte after it, or nullptr if
+// there is no number there or it does not fit in an int. The bytes up to
+// limit, from end on, can be read but are not part of the number.
+static inline const char *parse_int(const char *p, const char *end,
+                                    const char *limit, int *out)
+{
+  static const int64_t pow10[] = {1, 10, 100, 1000, 10000, 100000,
+                                  1000000, 10000000, 100000000};
+  bool negative = p < end && *p == '-';
+  p += negative;
+  const char *begin = p;
+  int64_t value = 0;
+  // 8 digits at a time while 8 bytes can be read
+  while (limit - p >= 8 && value <= INT32_MAX)
+  {
+    uint64_t chunk;
+    memcpy(&chunk, p, 8);
+    int n = std::min<int64_t>(swar_digits(chunk), end - p);
+    if (n == 0)
+      break;
+    value = value * pow10[n] + swar_value(chunk, n);
+    p += n;
+    if (n < 8)
+      break;
+  }
+  // the last bytes of the file
+  while (p < end && *p >= '0' && *p <= '9' && value <= INT32_MAX)
+    value = value * 10 + (*p++ - '0');
+
+  if (p == begin || value > INT32_MAX + (int64_t)negative)
+    return nullptr;
+  *out = (int)(negative ? -value : value);
+  return p;
+}
+
+// calls fn(line begin, line end) for the non blank lines of [p, end), with
+// the line end before the '\n' or "\r\n", until fn returns false
+template <typename F>
+static inline void for_each_csv_line(const char *p, const char *end, F fn)
+{
+  while (p < end)
+  {
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    const char *eol = nl ? nl : end;
+    const char *next = nl ? nl + 1 : end;
+    if (eol > p && eol[-1] == '\r')
+      eol--;
+    if (eol > p && !fn(p, eol))
+      return;
+    p = next;
+  }
+}
+
+// runs fn(0), ..., fn(num_threads - 1), fn(0) on the calling thread and
+// the others on threads of their own
+template <typename F> static inline void run_chunks(size_t num_threads, F fn)
+{
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < num_threads; t++)
+    threads.push_back(std::thread(fn, t));
+  fn(0);
+  for (auto &u : threads)
+    u.join();
+}
+
+// Loads the "a,b" lines of the CSV file at path into rows with num_threads
+// threads, blank lines are skipped. Sets error on a malformed line, and
+// fills stats if it is not null.
+static inline bool load_csv(const char *path, std::vector<Row> &rows,
+                            int num_threads, csv_stats *stats,
+                            std::string &error)
+{
+  auto start = std::chrono::steady_clock::now();
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    error = std::string("cannot open ") + path + ": " + strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    error = std::string("cannot stat ") + path + ": " + strerror(errno);
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  const char *data = "";
+  if (size > 0)
+  {
+    void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+    {
+      error = std::string("cannot map ") + path + ": " + strerror(errno);
+      close(fd);
+      return false;
+    }
+    data = (const char *)p;
+    madvise(p, size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  const char *end = data + size;
+
+  // chunk t is [cut[t], cut[t + 1]), every cut but the ends is after a '\n'
+  size_t T = std::max(num_threads, 1);
+  std::vector<const char *> cut(T + 1, end);
+  cut[0] = data;
+  for (size_t t = 1; t < T; t++)
+  {
+    const char *p = std::max(data + size * t / T, cut[t - 1]);
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    cut[t] = nl ? nl + 1 : end;
+  }
+
+  // pass 1: the rows of every chunk and where they start in the table
+  std::vector<size_t> first(T + 1, 0);
+  run_chunks(T, [&](size_t t)
+             {
+               size_t n = 0;
+               for_each_csv_line(cut[t], cut[t + 1],
+                                 [&](const char *, const char *)
+                                 {
+                                   n++;
+                                   return true;
+                                 });
+               first[t + 1] = n;
+             });
+  for (size_t t = 0; t < T; t++)
+    first[t + 1] += first[t];
+  rows.resize(first[T]);
+
+  // pass 2: every chunk parses its rows into its part of the table
+  std::vector<size_t> bad_row(T, SIZE_MAX);
+  run_chunks(T, [&](size_t t)
+             {
+               size_t i = first[t];
+               for_each_csv_line(cut[t], cut[t + 1],
+                                 [&](const char *p, const char *eol)
+                                 {
+                                   Row &row = rows[i];
+                                   p = parse_int(p, eol, end, &row.a);
+                                   if (p && p < eol && *p == ',')
+                                     p = parse_int(p + 1, eol, end, &row.b);
+                                   else
+                                     p = nullptr;
+                                   if (p != eol)
+                                   {
+                                     bad_row[t] = i;
+                                     return false;
+                                   }
+                                   i++;
+                                   return true;
+                                 });
+             });
+
+  if (size > 0)
+    munmap((void *)data, size);
+  size_t bad = *std::min_element(bad_row.begin(), bad_row.end());
+  if (bad != SIZE_MAX)
+  {
+    error = std::string(path) + ": malformed row " + std::to_string(bad + 1);
+    return false;
+  }
+  if (stats != nullptr)
+  {
+    stats->rows = rows.size();
+    stats->bytes = size;
+    stats->seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+  }
+  return true;
+}
+
+#endif
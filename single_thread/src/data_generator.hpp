@@ -0,0 +1,317 @@
+#ifndef DATA_GENERATOR_HPP
+#define DATA_GENERATOR_HPP
+
+#include "row.hpp"
+#include "table_file.hpp"
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Synthetic Row tables. Every value is a hash of the seed, its column and
+ * its row number, so a table only depends on the options and not on the
+ * number of threads that write it, and any range of rows can be generated
+ * on its own. Column a is uniform, column b, the key of the tree, follows
+ * one of the distributions.
+ */
+
+enum key_distribution
+{
+  DIST_UNIFORM,    // every key of [b_min, b_max] equally likely
+  DIST_ZIPF,       // key b_min + k with probability ~ 1 / (k + 1)^zipf_theta
+  DIST_SEQUENTIAL, // b_min, b_min + 1, ... wrapping around after b_max
+  DIST_CLUSTERED   // uniform within one of `clusters` ranges of cluster_width
+};
+
+struct generator_options
+{
+  uint64_t rows = 10000;
+  uint64_t seed = 42;
+  key_distribution distribution = DIST_UNIFORM;
+  int a_min = 1000, a_max = 5000; // the ranges of generateData
+  int b_min = 20, b_max = 100;
+  double zipf_theta = 0.99; // in (0, 1)
+  int clusters = 8;
+  int cluster_width = 4;
+  int threads = 1;
+};
+
+static inline bool parse_distribution(const std::string &name,
+                                      key_distribution *dist)
+{
+  static const char *names[] = {"uniform", "zipf", "sequential", "clustered"};
+  for (int i = 0; i < 4; i++)
+  {
+    if (name == names[i])
+    {
+      *dist = (key_distribution)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+class row_generator
+{
+private:
+  generator_options opt;
+  uint64_t b_range;
+  // the constants of the Zipf sampler of Gray et al., "Quickly generating
+  // billion-record synthetic databases"
+  double zeta_n, alpha, eta, half_pow_theta;
+
+  // a uniform 64-bit value for (column, row)
+  uint64_t random(uint64_t column, uint64_t row) const
+  {
+    return mix64(mix64(opt.seed + column) ^ row);
+  }
+
+  // a uniform value in [0, n)
+  static uint64_t below(uint64_t x, uint64_t n)
+  {
+    return (uint64_t)(((unsigned __int128)x * n) >> 64);
+  }
+
+  static double unit(uint64_t x) { return (x >> 11) * (1.0 / 9007199254740992.0); }
+
+  uint64_t zipf_rank(double u) const
+  {
+    double uz = u * zeta_n;
+    if (uz < 1.0)
+      return 0;
+    if (uz < 1.0 + half_pow_theta)
+      return 1;
+    uint64_t k = (uint64_t)(b_range * pow(eta * u - eta + 1.0, alpha));
+    return std::min(k, b_range - 1);
+  }
+
+public:
+  explicit row_generator(const generator_options &options)
+      : opt(options), b_range((int64_t)options.b_max - options.b_min + 1)
+  {
+    if (opt.distribution == DIST_ZIPF)
+    {
+      double theta = opt.zipf_theta;
+      zeta_n = 0;
+      for (uint64_t k = 1; k <= b_range; k++)
+        zeta_n += 1.0 / pow((double)k, theta);
+      double zeta_2 = 1.0 + 1.0 / pow(2.0, theta);
+      alpha = 1.0 / (1.0 - theta);
+      eta = (1.0 - pow(2.0 / b_range, 1.0 - theta)) / (1.0 - zeta_2 / zeta_n);
+      half_pow_theta = pow(0.5, theta);
+    }
+  }
+
+  // checks the options, sets error if they are not usable
+  static bool check(const generator_options &o, std::string &error)
+  {
+    if (o.a_min > o.a_max || o.b_min > o.b_max)
+      error = "empty value range";
+    else if (o.distribution == DIST_ZIPF &&
+             !(o.zipf_theta > 0 && o.zipf_theta < 1))
+      error = "zipf_theta must be in (0, 1)";
+    else if (o.distribution == DIST_CLUSTERED &&
+             (o.clusters < 1 || o.cluster_width < 1))
+      error = "clusters and cluster_width must be positive";
+    else
+      return true;
+    return false;
+  }
+
+  Row row(uint64_t i) const
+  {
+    Row r;
+    r.a = opt.a_min + (int)below(random(0, i), (int64_t)opt.a_max - opt.a_min + 1);
+    uint64_t k; // offset of b in [b_min, b_max]
+    switch (opt.distribution)
+    {
+    case DIST_ZIPF:
+      k = zipf_rank(unit(random(1, i)));
+      break;
+    case DIST_SEQUENTIAL:
+      k = i % b_range;
+      break;
+    case DIST_CLUSTERED:
+    {
+      uint64_t x = random(1, i);
+      uint64_t cluster = below(x, opt.clusters);
+      uint64_t start = below(random(2, cluster), b_range);
+      k = (start + below(mix64(x), opt.cluster_width)) % b_range;
+      break;
+    }
+    default:
+      k = below(random(1, i), b_range);
+    }
+    r.b = (int)(opt.b_min + (int64_t)k);
+    return r;
+  }
+};
+
+// rows generated and written per step of a thread
+#define GENERATOR_BLOCK (1 << 20)
+
+// Writes the table of the options to path in the binary format, every
+// thread generating blocks of rows and writing them at their offsets.
+static inline bool generate_table(const char *path,
+                                  const generator_options &opt,
+                                  table_layout layout, std::string &error)
+{
+  if (!row_generator::check(opt, error))
+    return false;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    error = std::string("cannot open ") + path + ": " + strerror(errno);
+    return false;
+  }
+
+  row_generator gen(opt);
+  table_file_header hdr = table_header(row_columns, opt.rows, layout);
+  uint64_t size = hdr.column_offset + (layout == TABLE_COLUMNS
+                                           ? hdr.column_stride * row_columns
+                                           : opt.rows * sizeof(Row));
+  bool ok = ftruncate(fd, size) == 0;
+
+  uint64_t num_blocks = (opt.rows + GENERATOR_BLOCK - 1) / GENERATOR_BLOCK;
+  std::atomic<uint64_t> next_block(0);
+  std::atomic<uint64_t> checksum(0);
+  std::atomic<bool> failed(!ok);
+  // a thread per block at most, with buffers no larger than the table
+  uint64_t num_threads = std::min<uint64_t>(std::max(opt.threads, 1),
+                                           std::max<uint64_t>(num_blocks, 1));
+  size_t block_rows = std::min<uint64_t>(opt.rows, GENERATOR_BLOCK);
+  auto work = [&]()
+  {
+    std::vector<Row> rows(block_rows);
+    std::vector<int> column(block_rows);
+    uint64_t sum = 0;
+    for (uint64_t b; !failed && (b = next_block++) < num_blocks;)
+    {
+      uint64_t first = b * GENERATOR_BLOCK;
+      size_t n = std::min<uint64_t>(GENERATOR_BLOCK, opt.rows - first);
+      for (size_t i = 0; i < n; i++)
+      {
+        rows[i] = gen.row(first + i);
+        sum += table_checksum_term(first + i, rows[i].a) +
+               table_checksum_term(opt.rows + first + i, rows[i].b);
+      }
+      if (layout == TABLE_ROWS)
+      {
+        off_t at = hdr.column_offset + first * sizeof(Row);
+        failed = failed || pwrite(fd, rows.data(), n * sizeof(Row), at) !=
+                               (ssize_t)(n * sizeof(Row));
+        continue;
+      }
+      for (int c = 0; c < row_columns; c++)
+      {
+        for (size_t i = 0; i < n; i++)
+          column[i] = c == 0 ? rows[i].a : rows[i].b;
+        off_t at = hdr.column_offset + c * hdr.column_stride + first * sizeof(int);
+        failed = failed || pwrite(fd, column.data(), n * sizeof(int), at) !=
+                               (ssize_t)(n * sizeof(int));
+      }
+    }
+    checksum += sum;
+  };
+  std::vector<std::thread> threads;
+  for (uint64_t t = 1; t < num_threads; t++)
+    threads.push_back(std::thread(work));
+  work();
+  for (auto &u : threads)
+    u.join();
+
+  hdr.checksum = checksum;
+  ok = !failed && pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+  ok = close(fd) == 0 && ok;
+  if (!ok)
+    error = std::string("cannot write ") + path;
+  return ok;
+}
+
+// appends the decimal digits of v to p, returns the end
+static inline char *format_int(char *p, int v)
+{
+  uint32_t u = v < 0 ? 0u - (uint32_t)v : (uint32_t)v;
+  if (v < 0)
+    *p++ = '-';
+  char digits[10];
+  int n = 0;
+  do
+  {
+    digits[n++] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  while (n)
+    *p++ = digits[--n];
+  return p;
+}
+
+// Writes the table of the options to path as "a,b" lines. The threads
+// format one block each into memory, then the blocks are written in order.
+static inline bool generate_csv(const char *path,
+                                const generator_options &opt,
+                                std::string &error)
+{
+  if (!row_generator::check(opt, error))
+    return false;
+  FILE *out = fopen(path, "w");
+  if (out == NULL)
+  {
+    error = std::string("cannot open ") + path + ": " + strerror(errno);
+    return false;
+  }
+
+  row_generator gen(opt);
+  uint64_t num_blocks = (opt.rows + GENERATOR_BLOCK - 1) / GENERATOR_BLOCK;
+  size_t T = std::min<uint64_t>(std::max(opt.threads, 1),
+                                std::max<uint64_t>(num_blocks, 1));
+  // a line is at most two 11 character ints, a comma and a newline, and a
+  // block holds no more rows than the table
+  size_t block_rows = std::min<uint64_t>(opt.rows, GENERATOR_BLOCK);
+  std::vector<std::vector<char>> text(T, std::vector<char>(block_rows * 24));
+  std::vector<size_t> length(T);
+  bool ok = true;
+  for (uint64_t round = 0; round < num_blocks && ok; round += T)
+  {
+    auto work = [&](size_t t)
+    {
+      length[t] = 0;
+      uint64_t first = (round + t) * GENERATOR_BLOCK;
+      if (first >= opt.rows)
+        return;
+      uint64_t last = std::min<uint64_t>(first + GENERATOR_BLOCK, opt.rows);
+      char *p = text[t].data();
+      for (uint64_t i = first; i < last; i++)
+      {
+        Row r = gen.row(i);
+        p = format_int(p, r.a);
+        *p++ = ',';
+        p = format_int(p, r.b);
+        *p++ = '\n';
+      }
+      length[t] = p - text[t].data();
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < T; t++)
+      threads.push_back(std::thread(work, t));
+    work(0);
+    for (auto &u : threads)
+      u.join();
+    for (size_t t = 0; t < T && ok; t++)
+      ok = fwrite(text[t].data(), 1, length[t], out) == length[t];
+  }
+  ok = fclose(out) == 0 && ok;
+  if (!ok)
+    error = std::string("cannot write ") + path;
+  return ok;
+}
+
+#endif
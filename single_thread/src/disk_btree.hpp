@@ -0,0 +1,616 @@
+#ifndef DISK_BTREE_HPP
+#define DISK_BTREE_HPP
+
+#include "btree.hpp"
+#include "buffer_pool.hpp"
+
+/*
+ * Out-of-core B+-tree: the pages live in a page_file and are only reached
+ * through a buffer_pool of a fixed number of frames, so the index can be
+ * much larger than the memory. Pages link to each other by page id instead
+ * of by pointer, and the values are 64-bit integers (e.g. row numbers)
+ * rather than pointers, which would not survive a restart. Page 0 holds the
+ * root and the height, written by flush.
+ *
+ * A page keeps its entries sorted with an entry count instead of the
+ * FAST&FAIR shifts, the tree is single threaded. Pages split like in
+ * btree.hpp but are not merged, a leaf emptied by deletes stays linked.
+ */
+
+// leaves a range scan reads ahead of the one it is in
+#ifndef DISK_READAHEAD
+#define DISK_READAHEAD 16
+#endif
+
+#define DISK_INDEX_MAGIC "DBEINDEX"
+#define DISK_INDEX_VERSION 1
+
+struct disk_meta
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  page_id root;
+  uint64_t height;
+  uint64_t num_keys;
+};
+
+struct disk_header
+{
+  page_id leftmost_ptr; // child of the keys below records[0].key
+  page_id sibling_ptr;  // right sibling, invalid_page for the last page
+  uint32_t level;       // 0 for the leaves
+  int32_t count;        // number of entries
+  uint64_t reserved;
+};
+
+struct disk_entry
+{
+  entry_key_t key;
+  uint64_t ptr; // child page id in internal pages, the value in leaves
+};
+
+const int disk_cardinality =
+    (DISK_PAGESIZE - sizeof(disk_header)) / sizeof(disk_entry);
+
+// Internal page i covers the keys between records[i - 1].key and
+// records[i].key, both inclusive: equal keys can be on both sides of a
+// split.
+struct disk_page
+{
+  disk_header hdr;
+  disk_entry records[disk_cardinality];
+
+  // the first entry whose key is not below key
+  int lower(entry_key_t key) const
+  {
+    return std::lower_bound(records, records + hdr.count, key,
+                            [](const disk_entry &e, entry_key_t k)
+                            { return e.key < k; }) -
+           records;
+  }
+
+  // the first entry whose key is above key
+  int upper(entry_key_t key) const
+  {
+    return std::upper_bound(records, records + hdr.count, key,
+                            [](entry_key_t k, const disk_entry &e)
+                            { return k < e.key; }) -
+           records;
+  }
+
+  // the child an insert of key goes to, after the equal keys
+  page_id child(entry_key_t key) const
+  {
+    int i = upper(key);
+    return i == 0 ? hdr.leftmost_ptr : records[i - 1].ptr;
+  }
+
+  // the leftmost child that can hold key
+  page_id first_child(entry_key_t key) const
+  {
+    int i = lower(key);
+    return i == 0 ? hdr.leftmost_ptr : records[i - 1].ptr;
+  }
+};
+
+static_assert(sizeof(disk_page) <= DISK_PAGESIZE, "a page fits in a frame");
+
+class disk_btree
+{
+private:
+  page_file file;
+  buffer_pool *pool;
+  page_id root;
+  uint32_t height;
+  uint64_t num_keys;
+
+  disk_page *pin(page_id id, bool sequential = false)
+  {
+    return (disk_page *)pool->pin(id, sequential);
+  }
+  void unpin(disk_page *p, bool dirty) { pool->unpin((char *)p, dirty); }
+
+  disk_page *new_page(uint32_t level, page_id *id)
+  {
+    disk_page *p = (disk_page *)pool->pin_new(id);
+    p->hdr.level = level;
+    return p;
+  }
+
+  // the leaf an insert of key goes to, the internal pages on the way are
+  // appended to path
+  page_id find_leaf(entry_key_t key, vector<page_id> *path)
+  {
+    page_id id = root;
+    for (uint32_t level = height - 1; level > 0; level--)
+    {
+      path->push_back(id);
+      disk_page *p = pin(id);
+      page_id next = p->child(key);
+      unpin(p, false);
+      id = next;
+    }
+    return id;
+  }
+
+  // The leftmost leaf that can hold key, pinned. When parent is not null
+  // it is set to the page above the leaf, and slot to the position of the
+  // leaf in it, 0 for the leftmost child.
+  disk_page *first_leaf(entry_key_t key, page_id *parent = nullptr,
+                        int *slot = nullptr)
+  {
+    page_id id = root;
+    disk_page *p = pin(id);
+    while (p->hdr.level > 0)
+    {
+      if (parent != nullptr && p->hdr.level == 1)
+      {
+        *parent = id;
+        *slot = p->lower(key);
+      }
+      id = p->first_child(key);
+      unpin(p, false);
+      p = pin(id);
+    }
+    return p;
+  }
+
+  // Reads ahead the leaves after the one at slot of parent, the children of
+  // parent and of its right siblings, up to DISK_READAHEAD of them and up
+  // to the first whose keys are all above max.
+  void readahead(page_id parent, int slot, entry_key_t max)
+  {
+    page_id ids[DISK_READAHEAD];
+    size_t n = 0;
+    bool past_max = false;
+    while (parent != invalid_page && n < DISK_READAHEAD && !past_max)
+    {
+      disk_page *p = pin(parent);
+      for (int c = slot + 1; c <= p->hdr.count && n < DISK_READAHEAD; c++)
+      {
+        ids[n++] = c == 0 ? p->hdr.leftmost_ptr : p->records[c - 1].ptr;
+        if (c > 0 && p->records[c - 1].key > max)
+        {
+          past_max = true;
+          break;
+        }
+      }
+      page_id next = p->hdr.sibling_ptr;
+      unpin(p, false);
+      parent = next;
+      slot = -1;
+    }
+    pool->prefetch(ids, n);
+  }
+
+  // moves (parent, slot) to the right sibling of its leaf
+  void next_slot(page_id *parent, int *slot)
+  {
+    disk_page *p = pin(*parent);
+    if (*slot < p->hdr.count)
+      ++*slot;
+    else
+    {
+      *parent = p->hdr.sibling_ptr;
+      *slot = 0;
+    }
+    unpin(p, false);
+  }
+
+  void insert_internal(vector<page_id> &path, entry_key_t key, page_id right);
+  void split(disk_page *p, disk_entry *entries, int n, vector<page_id> &path);
+  bool write_meta();
+
+public:
+  disk_btree() : pool(nullptr), root(invalid_page), height(0), num_keys(0) {}
+  ~disk_btree() { close(); }
+
+  disk_btree(const disk_btree &) = delete;
+  disk_btree &operator=(const disk_btree &) = delete;
+
+  bool open(const char *path, size_t pool_pages, std::string &error,
+            replacement_policy policy = REPLACE_2Q,
+            io_backend backend = IO_URING);
+  bool flush(std::string &error);
+  void close();
+
+  void btree_insert(entry_key_t, uint64_t);
+  bool btree_delete(entry_key_t);
+  bool btree_search(entry_key_t, uint64_t *);
+  void btree_search_range(entry_key_t, entry_key_t, unsigned long *,
+                          int &offset);
+  template <typename Visitor>
+  void btree_scan(entry_key_t, entry_key_t, bool, bool, Visitor);
+  void btree_bulk_load(const entry_key_t *, const uint64_t *, size_t,
+                       double fill_factor = 1.0);
+
+  uint64_t size() const { return num_keys; }
+  uint32_t levels() const { return height; }
+  uint64_t num_pages() const { return file.num_pages(); }
+  buffer_pool &buffer() { return *pool; }
+};
+
+// Opens the index file at path with a buffer pool of pool_pages frames,
+// creating an empty tree if the file does not exist. backend reads ahead
+// for the range scans and writes the flushes.
+bool disk_btree::open(const char *path, size_t pool_pages, std::string &error,
+                      replacement_policy policy, io_backend backend)
+{
+  close();
+  if (!file.open(path, error))
+    return false;
+  pool = new buffer_pool(file, std::max(pool_pages, (size_t)8), policy,
+                         backend);
+
+  if (file.num_pages() == 0)
+  {
+    file.allocate(); // the meta page
+    disk_page *p = new_page(0, &root);
+    unpin(p, true);
+    height = 1;
+    num_keys = 0;
+    return flush(error);
+  }
+
+  void *buf;
+  posix_memalign(&buf, DISK_PAGESIZE, DISK_PAGESIZE);
+  disk_meta *meta = (disk_meta *)buf;
+  if (!file.read(0, buf))
+    error = std::string("cannot read ") + path + ": " + strerror(errno);
+  else if (memcmp(meta->magic, DISK_INDEX_MAGIC, sizeof(meta->magic)) != 0)
+    error = std::string(path) + " is not an index file";
+  else if (meta->version != DISK_INDEX_VERSION ||
+           meta->page_size != DISK_PAGESIZE)
+    error = std::string(path) + ": unsupported version or page size";
+  else if (meta->root == invalid_page || meta->root >= file.num_pages() ||
+           meta->height == 0)
+    error = std::string(path) + ": corrupt index file";
+  else
+  {
+    root = meta->root;
+    height = meta->height;
+    num_keys = meta->num_keys;
+  }
+  free(buf);
+  if (root == invalid_page)
+    close();
+  return root != invalid_page;
+}
+
+bool disk_btree::write_meta()
+{
+  void *buf;
+  posix_memalign(&buf, DISK_PAGESIZE, DISK_PAGESIZE);
+  memset(buf, 0, DISK_PAGESIZE);
+  disk_meta *meta = (disk_meta *)buf;
+  memcpy(meta->magic, DISK_INDEX_MAGIC, sizeof(meta->magic));
+  meta->version = DISK_INDEX_VERSION;
+  meta->page_size = DISK_PAGESIZE;
+  meta->root = root;
+  meta->height = height;
+  meta->num_keys = num_keys;
+  bool ok = file.write(0, buf) && file.sync();
+  free(buf);
+  return ok;
+}
+
+// Writes the dirty pages back, then the meta page.
+bool disk_btree::flush(std::string &error)
+{
+  if (!pool->flush() || !write_meta())
+  {
+    error = std::string("cannot write the index: ") + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+// Flushes the tree and releases the buffer pool.
+void disk_btree::close()
+{
+  if (pool != nullptr && root != invalid_page)
+  {
+    std::string error;
+    if (!flush(error))
+      LOG(ERROR) << error << endl;
+  }
+  delete pool;
+  pool = nullptr;
+  file.close();
+  root = invalid_page;
+}
+
+// Splits the pinned page p whose new content, one entry more than fits, is
+// entries[0..n), and unpins it. The right half moves to a new page whose
+// separator goes up to the parent, the last page of path.
+void disk_btree::split(disk_page *p, disk_entry *entries, int n,
+                       vector<page_id> &path)
+{
+  int m = n / 2;
+  page_id right_id;
+  disk_page *right = new_page(p->hdr.level, &right_id);
+  entry_key_t separator = entries[m].key;
+  int first = m;
+  if (p->hdr.level > 0)
+  {
+    // the separator moves up, its child becomes the leftmost of the right
+    right->hdr.leftmost_ptr = entries[m].ptr;
+    first = m + 1;
+  }
+  right->hdr.count = n - first;
+  memcpy(right->records, entries + first, right->hdr.count * sizeof(disk_entry));
+  right->hdr.sibling_ptr = p->hdr.sibling_ptr;
+  p->hdr.sibling_ptr = right_id;
+  p->hdr.count = m;
+  memcpy(p->records, entries, m * sizeof(disk_entry));
+  unpin(right, true);
+  unpin(p, true);
+  insert_internal(path, separator, right_id);
+}
+
+// Inserts the separator of a new right page into the last page of path, or
+// into a new root when path is empty.
+void disk_btree::insert_internal(vector<page_id> &path, entry_key_t key,
+                                 page_id right)
+{
+  if (path.empty())
+  {
+    page_id id;
+    disk_page *p = new_page(height, &id);
+    p->hdr.leftmost_ptr = root;
+    p->records[0].key = key;
+    p->records[0].ptr = right;
+    p->hdr.count = 1;
+    unpin(p, true);
+    root = id;
+    ++height;
+    return;
+  }
+
+  page_id id = path.back();
+  path.pop_back();
+  disk_page *p = pin(id);
+  int i = p->upper(key);
+  if (p->hdr.count < disk_cardinality)
+  {
+    memmove(p->records + i + 1, p->records + i,
+            (p->hdr.count - i) * sizeof(disk_entry));
+    p->records[i] = disk_entry{key, right};
+    p->hdr.count++;
+    unpin(p, true);
+    return;
+  }
+  disk_entry entries[disk_cardinality + 1];
+  memcpy(entries, p->records, i * sizeof(disk_entry));
+  entries[i] = disk_entry{key, right};
+  memcpy(entries + i + 1, p->records + i, (p->hdr.count - i) * sizeof(disk_entry));
+  split(p, entries, disk_cardinality + 1, path);
+}
+
+// Inserts (key, value) after the entries with an equal key.
+void disk_btree::btree_insert(entry_key_t key, uint64_t value)
+{
+  vector<page_id> path;
+  disk_page *p = pin(find_leaf(key, &path));
+  int i = p->upper(key);
+  num_keys++;
+  if (p->hdr.count < disk_cardinality)
+  {
+    memmove(p->records + i + 1, p->records + i,
+            (p->hdr.count - i) * sizeof(disk_entry));
+    p->records[i] = disk_entry{key, value};
+    p->hdr.count++;
+    unpin(p, true);
+    return;
+  }
+  disk_entry entries[disk_cardinality + 1];
+  memcpy(entries, p->records, i * sizeof(disk_entry));
+  entries[i] = disk_entry{key, value};
+  memcpy(entries + i + 1, p->records + i, (p->hdr.count - i) * sizeof(disk_entry));
+  split(p, entries, disk_cardinality + 1, path);
+}
+
+// Looks up the first entry of key, false if there is none.
+bool disk_btree::btree_search(entry_key_t key, uint64_t *value)
+{
+  disk_page *p = first_leaf(key);
+  for (;;)
+  {
+    int i = p->lower(key);
+    if (i < p->hdr.count || p->hdr.sibling_ptr == invalid_page)
+    {
+      bool found = i < p->hdr.count && p->records[i].key == key;
+      if (found)
+        *value = p->records[i].ptr;
+      unpin(p, false);
+      return found;
+    }
+    // the leaf only has smaller keys, an equal one can be to the right
+    page_id next = p->hdr.sibling_ptr;
+    unpin(p, false);
+    p = pin(next);
+  }
+}
+
+// Removes the first entry of key, false if there is none.
+bool disk_btree::btree_delete(entry_key_t key)
+{
+  disk_page *p = first_leaf(key);
+  for (;;)
+  {
+    int i = p->lower(key);
+    if (i < p->hdr.count || p->hdr.sibling_ptr == invalid_page)
+    {
+      bool found = i < p->hdr.count && p->records[i].key == key;
+      if (found)
+      {
+        memmove(p->records + i, p->records + i + 1,
+                (p->hdr.count - i - 1) * sizeof(disk_entry));
+        p->hdr.count--;
+        num_keys--;
+      }
+      unpin(p, found);
+      return found;
+    }
+    page_id next = p->hdr.sibling_ptr;
+    unpin(p, false);
+    p = pin(next);
+  }
+}
+
+// Calls visit(key, value) for the entries with min < key < max, in key
+// order, until visit returns false. min_inclusive and max_inclusive also
+// take in the entries equal to the bounds. Only one leaf is pinned at a
+// time, the leaves after the first one with the sequential hint, so a long
+// scan does not push the pages of the lookups out of the buffer pool. With
+// asynchronous I/O the next DISK_READAHEAD leaves are read in the
+// background, found in the pages above the leaves.
+template <typename Visitor>
+void disk_btree::btree_scan(entry_key_t min, entry_key_t max,
+                            bool min_inclusive, bool max_inclusive,
+                            Visitor visit)
+{
+  page_id parent = invalid_page;
+  int slot = 0;
+  disk_page *p = first_leaf(min, &parent, &slot);
+  bool read_ahead = pool->async() && parent != invalid_page;
+  int ahead = 0; // leaves until the next read-ahead
+  for (;;)
+  {
+    // only when the scan goes past this leaf, half the window at a time
+    if (read_ahead && (p->hdr.count == 0 ||
+                       p->records[p->hdr.count - 1].key <= max) &&
+        ahead-- <= 0)
+    {
+      readahead(parent, slot, max);
+      ahead = DISK_READAHEAD / 2;
+    }
+    int i = min_inclusive ? p->lower(min) : p->upper(min);
+    for (; i < p->hdr.count; i++)
+    {
+      entry_key_t k = p->records[i].key;
+      if (k > max || (k == max && !max_inclusive) ||
+          !visit(k, p->records[i].ptr))
+      {
+        unpin(p, false);
+        return;
+      }
+    }
+    page_id next = p->hdr.sibling_ptr;
+    unpin(p, false);
+    if (next == invalid_page)
+      return;
+    if (read_ahead)
+      next_slot(&parent, &slot);
+    p = pin(next, true);
+  }
+}
+
+void disk_btree::btree_search_range(entry_key_t min, entry_key_t max,
+                                    unsigned long *buf, int &offset)
+{
+  btree_scan(min, max, false, false,
+             [&](entry_key_t, uint64_t value)
+             {
+               buf[offset++] = value;
+               return true;
+             });
+}
+
+// Builds an empty tree bottom-up from (key, value) pairs like
+// btree::btree_bulk_load: the leaves are written in key order, packed to
+// fill_factor, then the internal levels. A tree that is not empty gets the
+// pairs through btree_insert.
+void disk_btree::btree_bulk_load(const entry_key_t *keys,
+                                 const uint64_t *values, size_t num,
+                                 double fill_factor)
+{
+  if (height > 1 || num_keys > 0)
+  {
+    for (size_t i = 0; i < num; i++)
+      btree_insert(keys[i], values[i]);
+    return;
+  }
+  if (num == 0)
+    return;
+
+  vector<entry_key_t> sorted_keys;
+  vector<uint64_t> sorted_values;
+  if (!std::is_sorted(keys, keys + num))
+  {
+    vector<pair<entry_key_t, size_t>> order(num);
+    for (size_t i = 0; i < num; i++)
+      order[i] = make_pair(keys[i], i);
+    std::sort(order.begin(), order.end());
+    sorted_keys.resize(num);
+    sorted_values.resize(num);
+    for (size_t i = 0; i < num; i++)
+    {
+      sorted_keys[i] = order[i].first;
+      sorted_values[i] = values[order[i].second];
+    }
+    keys = sorted_keys.data();
+    values = sorted_values.data();
+  }
+
+  int fill = std::min(std::max((int)(disk_cardinality * fill_factor), 1),
+                      disk_cardinality);
+  // the pages of the level being built and their smallest keys
+  vector<page_id> pages;
+  vector<entry_key_t> low_keys;
+  disk_page *prev = nullptr;
+  for (size_t begin = 0; begin < num; begin += fill)
+  {
+    page_id id = root; // the empty root is the first leaf
+    disk_page *p = begin == 0 ? pin(root) : new_page(0, &id);
+    p->hdr.count = std::min((size_t)fill, num - begin);
+    for (int i = 0; i < p->hdr.count; i++)
+      p->records[i] = disk_entry{keys[begin + i], values[begin + i]};
+    if (prev != nullptr)
+    {
+      prev->hdr.sibling_ptr = id;
+      unpin(prev, true);
+    }
+    prev = p;
+    pages.push_back(id);
+    low_keys.push_back(keys[begin]);
+  }
+  unpin(prev, true);
+
+  uint32_t level = 0;
+  // every parent gets at least two children
+  size_t fanout = std::max(fill + 1, 3);
+  while (pages.size() > 1)
+  {
+    ++level;
+    size_t num_parents = (pages.size() + fanout - 1) / fanout;
+    vector<page_id> parents(num_parents);
+    vector<entry_key_t> parent_keys(num_parents);
+    prev = nullptr;
+    for (size_t i = 0; i < num_parents; i++)
+    {
+      size_t begin = pages.size() * i / num_parents;
+      size_t end = pages.size() * (i + 1) / num_parents;
+      disk_page *p = new_page(level, &parents[i]);
+      p->hdr.leftmost_ptr = pages[begin];
+      for (size_t c = begin + 1; c < end; c++)
+        p->records[p->hdr.count++] = disk_entry{low_keys[c], pages[c]};
+      parent_keys[i] = low_keys[begin];
+      if (prev != nullptr)
+      {
+        prev->hdr.sibling_ptr = parents[i];
+        unpin(prev, true);
+      }
+      prev = p;
+    }
+    unpin(prev, true);
+    pages.swap(parents);
+    low_keys.swap(parent_keys);
+  }
+  root = pages[0];
+  height = level + 1;
+  num_keys = num;
+}
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef FILTER_HPP
+#define FILTER_HPP
+
+#include "simd_search.hpp"
+#include <algorithm>
+#include <climits>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Filter kernels over a column of n ints. They write a selection bitmap:
+ * bit i of bits[i / 64] is set when value i matches, the bits past n in the
+ * last word are 0. The kernels never branch on the values, and they are
+ * picked with the same cpuid check as the rank kernels.
+ */
+
+static inline int bitmap_words(int n) { return (n + 63) / 64; }
+
+static inline void bitmap_clear(uint64_t *bits, int n)
+{
+  for (int w = 0; w < bitmap_words(n); w++)
+    bits[w] = 0;
+}
+
+static inline void bitmap_fill(uint64_t *bits, int n)
+{
+  for (int w = 0; w < n / 64; w++)
+    bits[w] = ~0ULL;
+  if (n % 64)
+    bits[n / 64] = (1ULL << (n % 64)) - 1;
+}
+
+static inline void bitmap_and(uint64_t *bits, const uint64_t *other, int n)
+{
+  for (int w = 0; w < bitmap_words(n); w++)
+    bits[w] &= other[w];
+}
+
+static inline void bitmap_or(uint64_t *bits, const uint64_t *other, int n)
+{
+  for (int w = 0; w < bitmap_words(n); w++)
+    bits[w] |= other[w];
+}
+
+static inline void bitmap_not(uint64_t *bits, int n)
+{
+  for (int w = 0; w < n / 64; w++)
+    bits[w] = ~bits[w];
+  if (n % 64)
+    bits[n / 64] = ~bits[n / 64] & ((1ULL << (n % 64)) - 1);
+}
+
+// calls fn(i) for every set bit i
+template <typename F>
+static inline void bitmap_for_each(const uint64_t *bits, int n, F fn)
+{
+  for (int w = 0; w < bitmap_words(n); w++)
+  {
+    for (uint64_t word = bits[w]; word; word &= word - 1)
+      fn(w * 64 + __builtin_ctzll(word));
+  }
+}
+
+// lo <= col[i] <= hi, from word `from` on
+static inline void between_scalar(const int *col, int n, int lo, int hi,
+                                  uint64_t *bits, int from = 0)
+{
+  // one unsigned compare: col[i] - lo wraps around when col[i] < lo
+  uint32_t width = (uint32_t)hi - (uint32_t)lo;
+  for (int w = from; w < bitmap_words(n); w++)
+  {
+    const int *c = col + w * 64;
+    int end = std::min(64, n - w * 64);
+    uint64_t word = 0;
+    for (int i = 0; i < end; i++)
+      word |= (uint64_t)((uint32_t)c[i] - (uint32_t)lo <= width) << i;
+    bits[w] = word;
+  }
+}
+
+// col[i] is one of the values, from word `from` on
+static inline void in_scalar(const int *col, int n, const int *values,
+                             int num_values, uint64_t *bits, int from = 0)
+{
+  for (int w = from; w < bitmap_words(n); w++)
+  {
+    const int *c = col + w * 64;
+    int end = std::min(64, n - w * 64);
+    uint64_t word = 0;
+    for (int i = 0; i < end; i++)
+    {
+      bool match = false;
+      for (int v = 0; v < num_values; v++)
+        match |= c[i] == values[v];
+      word |= (uint64_t)match << i;
+    }
+    bits[w] = word;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 8 values per compare, the words of 64 full values are done with AVX2
+__attribute__((target("avx2"))) static void
+between_avx2(const int *col, int n, int lo, int hi, uint64_t *bits)
+{
+  const __m256i vlo = _mm256_set1_epi32(lo);
+  const __m256i vhi = _mm256_set1_epi32(hi);
+  int w = 0;
+  for (; (w + 1) * 64 <= n; w++)
+  {
+    uint64_t word = 0;
+    for (int g = 0; g < 8; g++)
+    {
+      __m256i x = _mm256_loadu_si256((const __m256i *)(col + w * 64 + g * 8));
+      // outside: lo > x or x > hi
+      __m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(vlo, x),
+                                    _mm256_cmpgt_epi32(x, vhi));
+      uint32_t m = ~_mm256_movemask_ps(_mm256_castsi256_ps(out)) & 0xff;
+      word |= (uint64_t)m << (g * 8);
+    }
+    bits[w] = word;
+  }
+  between_scalar(col, n, lo, hi, bits, w);
+}
+
+__attribute__((target("avx2"))) static void
+in_avx2(const int *col, int n, const int *values, int num_values,
+        uint64_t *bits)
+{
+  int w = 0;
+  for (; (w + 1) * 64 <= n; w++)
+  {
+    uint64_t word = 0;
+    for (int g = 0; g < 8; g++)
+    {
+      __m256i x = _mm256_loadu_si256((const __m256i *)(col + w * 64 + g * 8));
+      __m256i match = _mm256_setzero_si256();
+      for (int v = 0; v < num_values; v++)
+        match = _mm256_or_si256(
+            match, _mm256_cmpeq_epi32(x, _mm256_set1_epi32(values[v])));
+      uint32_t m = _mm256_movemask_ps(_mm256_castsi256_ps(match));
+      word |= (uint64_t)m << (g * 8);
+    }
+    bits[w] = word;
+  }
+  in_scalar(col, n, values, num_values, bits, w);
+}
+#endif
+
+// lo <= col[i] <= hi, the bounds may be outside of the int range
+static inline void filter_between(const int *col, int n, int64_t lo,
+                                  int64_t hi, uint64_t *bits,
+                                  rank_isa isa = cpu_rank_isa)
+{
+  lo = std::max(lo, (int64_t)INT_MIN);
+  hi = std::min(hi, (int64_t)INT_MAX);
+  if (lo > hi)
+  {
+    bitmap_clear(bits, n);
+    return;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  if (isa == RANK_AVX2)
+  {
+    between_avx2(col, n, (int)lo, (int)hi, bits);
+    return;
+  }
+#endif
+  between_scalar(col, n, (int)lo, (int)hi, bits);
+}
+
+static inline void filter_eq(const int *col, int n, int64_t value,
+                             uint64_t *bits, rank_isa isa = cpu_rank_isa)
+{
+  filter_between(col, n, value, value, bits, isa);
+}
+
+// col[i] is one of the num_values values, narrowed to ints beforehand
+static inline void filter_in(const int *col, int n, const int *values,
+                             int num_values, uint64_t *bits,
+                             rank_isa isa = cpu_rank_isa)
+{
+  if (num_values == 0)
+  {
+    bitmap_clear(bits, n);
+    return;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  if (isa == RANK_AVX2)
+  {
+    in_avx2(col, n, values, num_values, bits);
+    return;
+  }
+#endif
+  in_scalar(col, n, values, num_values, bits);
+}
+
+#endif
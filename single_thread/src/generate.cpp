@@ -0,0 +1,63 @@
+#include "data_generator.hpp"
+#include <chrono>
+#include <thread>
+#include <gflags/gflags.h> // yum install gflags gflags-devel
+
+DEFINE_uint64(rows, 10000, "number of rows to generate, up to billions");
+DEFINE_uint64(seed, 42, "seed of the rows, the same seed gives the same rows");
+DEFINE_string(distribution, "uniform", "distribution of the b keys: uniform, zipf, sequential or clustered");
+DEFINE_double(theta, 0.99, "skew of the zipf distribution, in (0, 1)");
+DEFINE_int32(clusters, 8, "number of key ranges of the clustered distribution");
+DEFINE_int32(cluster_width, 4, "number of keys of a range of the clustered distribution");
+DEFINE_int32(b_min, 20, "smallest b key");
+DEFINE_int32(b_max, 100, "largest b key");
+DEFINE_string(format, "binary", "output format: binary (columns layout), rows (binary rows layout, for mapping) or csv");
+DEFINE_string(output, "input.tbl", "file the rows are written to");
+DEFINE_int32(threads, std::thread::hardware_concurrency(), "number of threads generating rows");
+
+// e.g. ./generate --rows=1000000000 --distribution=zipf --output=big.tbl
+int main(int argc, char *argv[])
+{
+    google::ParseCommandLineFlags(&argc, &argv, true);
+
+    generator_options opt;
+    opt.rows = FLAGS_rows;
+    opt.seed = FLAGS_seed;
+    opt.zipf_theta = FLAGS_theta;
+    opt.clusters = FLAGS_clusters;
+    opt.cluster_width = FLAGS_cluster_width;
+    opt.b_min = FLAGS_b_min;
+    opt.b_max = FLAGS_b_max;
+    opt.threads = FLAGS_threads;
+    if (!parse_distribution(FLAGS_distribution, &opt.distribution))
+    {
+        fprintf(stderr, "unknown distribution: %s\n", FLAGS_distribution.c_str());
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::string error;
+    bool ok;
+    if (FLAGS_format == "csv")
+        ok = generate_csv(FLAGS_output.c_str(), opt, error);
+    else if (FLAGS_format == "binary" || FLAGS_format == "rows")
+        ok = generate_table(FLAGS_output.c_str(), opt,
+                            FLAGS_format == "rows" ? TABLE_ROWS : TABLE_COLUMNS,
+                            error);
+    else
+    {
+        fprintf(stderr, "unknown format: %s\n", FLAGS_format.c_str());
+        return 1;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start).count();
+    printf("%lu rows written to %s in %.2f s, %.1f Mrows/s\n",
+           (unsigned long)opt.rows, FLAGS_output.c_str(), seconds,
+           opt.rows / seconds / 1e6);
+    return 0;
+}
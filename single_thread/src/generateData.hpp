@@ -1,5 +1,8 @@
+#include "data_generator.hpp"
+#include "table_file.hpp"
 #include <iostream>
 #include <cstdio>
+#include <vector>
 using namespace std;
 
 FILE *openFile(char *fileName, char *mode) {
@@ -11,18 +14,28 @@ FILE *openFile(char *fileName, char *mode) {
     return fp;
 }
 
-void generateData(int num_ways, int run_size){
-    char input_file[] = "input.txt";
-
-    FILE *in = openFile(input_file, "w");
-
-    srand(unsigned(time(NULL)));
+// num_ways * run_size rows of the options written to input.txt, by default
+// a in [1000, 5000] and b in [20, 100], both uniform
+void generateData(int num_ways, int run_size,
+                  generator_options opt = generator_options()){
+    opt.rows = (uint64_t)num_ways * run_size;
+    string error;
+    if (!generate_csv("input.txt", opt, error)){
+        fprintf(stderr, "%s\n", error.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
 
-    // https://www.runoob.com/w3cnote/cpp-rand-srand.html
-    // 生成两个数字，第一个数的范围是 [1000, 5000]，第二个数的范围是 [20, 100]
-    for (int i = 0; i < num_ways * run_size; i++)
-        fprintf(in, "%d,%d\n", (rand() % (5000-1000+1) + 1000), (rand() % (100-20+1) + 20));
-    fclose(in);
+// the same rows as generateData, written to path as a binary table file
+void generateTable(const char *path, int num_ways, int run_size,
+                   table_layout layout = TABLE_COLUMNS,
+                   generator_options opt = generator_options()){
+    opt.rows = (uint64_t)num_ways * run_size;
+    string error;
+    if (!generate_table(path, opt, layout, error)){
+        fprintf(stderr, "%s\n", error.c_str());
+        exit(EXIT_FAILURE);
+    }
 }
 
 /**
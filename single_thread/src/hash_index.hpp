@@ -0,0 +1,93 @@
+#ifndef HASH_INDEX_HPP
+#define HASH_INDEX_HPP
+
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Hash index on an int column for equality lookups. Every distinct value
+ * has a slot of an open addressing table, probed linearly, that holds the
+ * range of its row ids in one postings array. Like the bulk loaded tree it
+ * is built once over the whole table.
+ */
+class hash_index
+{
+private:
+  struct slot
+  {
+    int key;
+    int begin; // first row id in row_ids
+    int count; // 0 for an empty slot
+  };
+
+  std::vector<slot> slots;
+  uint32_t mask;
+  std::vector<int> row_ids;
+
+  uint32_t home(int key) const
+  {
+    return (uint32_t)(((uint64_t)(uint32_t)key * 0x9E3779B97F4A7C15ULL) >>
+                      32) & mask;
+  }
+
+  // the slot of key, or the empty slot where it would go
+  uint32_t find(int key) const
+  {
+    uint32_t i = home(key);
+    while (slots[i].count != 0 && slots[i].key != key)
+      i = (i + 1) & mask;
+    return i;
+  }
+
+public:
+  hash_index(const int *column, int nrows)
+  {
+    // at most half full even if all the values are distinct
+    uint32_t capacity = 16;
+    while (capacity < 2 * (uint32_t)nrows)
+      capacity <<= 1;
+    slots.assign(capacity, slot{0, 0, 0});
+    mask = capacity - 1;
+
+    for (int i = 0; i < nrows; i++)
+    {
+      slot &s = slots[find(column[i])];
+      s.key = column[i];
+      s.count++;
+    }
+    int begin = 0;
+    for (auto &s : slots)
+    {
+      s.begin = begin;
+      begin += s.count;
+    }
+    // the row ids of a value end up in ascending order
+    row_ids.resize(nrows);
+    std::vector<int> filled(capacity, 0);
+    for (int i = 0; i < nrows; i++)
+    {
+      uint32_t s = find(column[i]);
+      row_ids[slots[s].begin + filled[s]++] = i;
+    }
+  }
+
+  // number of rows whose value is key
+  int count(int64_t key) const
+  {
+    if (key < INT32_MIN || key > INT32_MAX)
+      return 0;
+    return slots[find((int)key)].count;
+  }
+
+  // calls fn(row id) for every row whose value is key
+  template <typename F> void probe(int64_t key, F fn) const
+  {
+    if (key < INT32_MIN || key > INT32_MAX)
+      return;
+    const slot &s = slots[find((int)key)];
+    for (int i = 0; i < s.count; i++)
+      fn(row_ids[s.begin + i]);
+  }
+};
+
+#endif
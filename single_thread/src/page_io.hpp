@@ -0,0 +1,392 @@
+#ifndef PAGE_IO_HPP
+#define PAGE_IO_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <glog/logging.h>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Asynchronous page reads and writes: requests are queued, submitted as a
+ * batch and complete in any order, each with the tag it was queued with.
+ * io_uring is driven through its system calls and the two mapped rings,
+ * without liburing. Where the kernel refuses io_uring_setup (old kernels,
+ * seccomp filters) or lacks IORING_OP_READ and IORING_OP_WRITE (before
+ * 5.6) a pool of threads runs pread and pwrite instead.
+ */
+
+enum io_backend
+{
+  IO_SYNC,    // no asynchronous I/O, every page is read when it is pinned
+  IO_THREADS, // pread and pwrite on a pool of threads
+  IO_URING    // io_uring, IO_THREADS if the kernel does not allow it
+};
+
+struct io_completion
+{
+  uint64_t tag;
+  int result; // bytes transferred, or -errno
+};
+
+class page_io
+{
+private:
+  struct request
+  {
+    bool write;
+    void *buf;
+    size_t len;
+    off_t offset;
+    uint64_t tag;
+  };
+
+  io_backend backend_;
+  int fd;
+  unsigned depth;
+  unsigned in_flight; // queued and not handed out by next yet
+  std::vector<io_completion> ready;
+
+  // io_uring
+  int ring_fd;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+  io_uring_sqe *sqes;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_cqe *cqes;
+  unsigned sq_entries;
+  unsigned unsubmitted;
+
+  // thread pool
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable queued_cv, done_cv;
+  std::deque<request> queued;
+  std::vector<io_completion> done;
+  std::vector<request> batch; // queued until submit
+  bool stopping;
+
+  bool setup_uring()
+  {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (ring_fd < 0)
+      return false;
+    sq_entries = p.sq_entries;
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+      sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP)
+                  ? sq_ring
+                  : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    sqes = (io_uring_sqe *)mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe),
+                                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                ring_fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+    {
+      stop_uring();
+      return false;
+    }
+    char *sq = (char *)sq_ring, *cq = (char *)cq_ring;
+    sq_head = (unsigned *)(sq + p.sq_off.head);
+    sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+    cq_head = (unsigned *)(cq + p.cq_off.head);
+    cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+    unsubmitted = 0;
+    if (!supports_read_write())
+    {
+      stop_uring();
+      return false;
+    }
+    return true;
+  }
+
+  // IORING_OP_READ and IORING_OP_WRITE came with IORING_REGISTER_PROBE in
+  // 5.6, on older kernels the probe fails as well
+  bool supports_read_write()
+  {
+    const unsigned num_ops = 256;
+    std::vector<char> buf(sizeof(io_uring_probe) +
+                          num_ops * sizeof(io_uring_probe_op));
+    io_uring_probe *probe = (io_uring_probe *)buf.data();
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe,
+                num_ops) < 0)
+      return false;
+    auto supported = [&](unsigned op)
+    {
+      return op <= probe->last_op &&
+             (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    };
+    return supported(IORING_OP_READ) && supported(IORING_OP_WRITE);
+  }
+
+  void stop_uring()
+  {
+    if (sqes != nullptr && sqes != MAP_FAILED)
+      munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+    if (cq_ring != nullptr && cq_ring != MAP_FAILED && cq_ring != sq_ring)
+      munmap(cq_ring, cq_ring_size);
+    if (sq_ring != nullptr && sq_ring != MAP_FAILED)
+      munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0)
+      ::close(ring_fd);
+    ring_fd = -1;
+    sq_ring = cq_ring = nullptr;
+    sqes = nullptr;
+  }
+
+  void queue_uring(const request &r)
+  {
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = r.write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)r.buf;
+    sqe->len = r.len;
+    sqe->off = r.offset;
+    sqe->user_data = r.tag;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted++;
+  }
+
+  // Enters the kernel with the new requests, waiting for min_complete. If
+  // the kernel refuses them they complete with the error; a failed wait
+  // leaves requests that can never be reaped, which is fatal.
+  void enter_uring(unsigned min_complete)
+  {
+    for (;;)
+    {
+      int ret = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, min_complete,
+                        min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+      if (ret >= 0)
+      {
+        unsubmitted -= ret;
+        if (unsubmitted == 0)
+          return;
+        continue;
+      }
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      int error = errno;
+      if (unsubmitted == 0)
+        LOG(FATAL) << "cannot wait for io_uring completions: "
+                   << strerror(error);
+      // take back the requests the kernel did not consume
+      unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+      for (unsigned i = head; i != *sq_tail; i++)
+        ready.push_back(io_completion{sqes[i & *sq_mask].user_data, -error});
+      __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+      unsubmitted = 0;
+      return;
+    }
+  }
+
+  void reap_uring()
+  {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+      io_uring_cqe *cqe = &cqes[head & *cq_mask];
+      ready.push_back(io_completion{cqe->user_data, cqe->res});
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  void work()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+      queued_cv.wait(lock, [&] { return stopping || !queued.empty(); });
+      if (queued.empty())
+        return;
+      request r = queued.front();
+      queued.pop_front();
+      lock.unlock();
+      ssize_t n = r.write ? pwrite(fd, r.buf, r.len, r.offset)
+                          : pread(fd, r.buf, r.len, r.offset);
+      int result = n < 0 ? -errno : (int)n;
+      lock.lock();
+      done.push_back(io_completion{r.tag, result});
+      done_cv.notify_one();
+    }
+  }
+
+  void stop_threads()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    queued_cv.notify_all();
+    for (auto &t : workers)
+      t.join();
+    workers.clear();
+  }
+
+  // moves the completions of the backend to ready, waiting for a new one
+  // if block
+  void reap(bool block)
+  {
+    if (backend_ == IO_URING)
+    {
+      size_t before = ready.size();
+      reap_uring();
+      if (ready.size() == before && block)
+      {
+        enter_uring(1);
+        reap_uring();
+      }
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if (block)
+      done_cv.wait(lock, [&] { return !done.empty(); });
+    ready.insert(ready.end(), done.begin(), done.end());
+    done.clear();
+  }
+
+  void queue(const request &r)
+  {
+    // a full ring submits what it has and waits for room
+    while (in_flight - ready.size() >= depth)
+    {
+      submit();
+      reap(true);
+    }
+    in_flight++;
+    if (backend_ == IO_URING)
+      queue_uring(r);
+    else
+      batch.push_back(r);
+  }
+
+public:
+  page_io()
+      : backend_(IO_SYNC), fd(-1), depth(0), in_flight(0), ring_fd(-1),
+        sq_ring(nullptr), cq_ring(nullptr), sqes(nullptr), stopping(false)
+  {
+  }
+
+  ~page_io() { stop(); }
+
+  page_io(const page_io &) = delete;
+  page_io &operator=(const page_io &) = delete;
+
+  // Starts the backend on the file descriptor fd with up to depth requests
+  // in flight. Returns the backend that runs, IO_URING falls back to
+  // IO_THREADS.
+  io_backend start(int file, io_backend backend, unsigned queue_depth = 64,
+                   int num_threads = 4)
+  {
+    stop();
+    fd = file;
+    depth = queue_depth;
+    backend_ = backend;
+    if (backend_ == IO_URING && !setup_uring())
+      backend_ = IO_THREADS;
+    if (backend_ == IO_THREADS)
+    {
+      stopping = false;
+      for (int t = 0; t < num_threads; t++)
+        workers.push_back(std::thread(&page_io::work, this));
+    }
+    return backend_;
+  }
+
+  // waits for the requests in flight and stops the backend
+  void stop()
+  {
+    io_completion c;
+    while (next(&c, true))
+      ;
+    if (backend_ == IO_URING)
+      stop_uring();
+    if (backend_ == IO_THREADS)
+      stop_threads();
+    backend_ = IO_SYNC;
+  }
+
+  io_backend backend() const { return backend_; }
+  bool async() const { return backend_ != IO_SYNC; }
+  unsigned pending() const { return in_flight; }
+
+  void read(void *buf, size_t len, off_t offset, uint64_t tag)
+  {
+    queue(request{false, buf, len, offset, tag});
+  }
+
+  void write(const void *buf, size_t len, off_t offset, uint64_t tag)
+  {
+    queue(request{true, (void *)buf, len, offset, tag});
+  }
+
+  // hands the queued requests to the kernel or the threads
+  void submit()
+  {
+    if (backend_ == IO_URING)
+    {
+      if (unsubmitted > 0)
+        enter_uring(0);
+      return;
+    }
+    if (batch.empty())
+      return;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queued.insert(queued.end(), batch.begin(), batch.end());
+    }
+    batch.clear();
+    queued_cv.notify_all();
+  }
+
+  // The next completed request, false if there is none. With block it
+  // waits for one as long as requests are in flight.
+  bool next(io_completion *c, bool block)
+  {
+    if (in_flight == 0)
+      return false;
+    if (ready.empty())
+    {
+      submit();
+      reap(block);
+      if (ready.empty())
+        return false;
+    }
+    *c = ready.back();
+    ready.pop_back();
+    in_flight--;
+    return true;
+  }
+};
+
+static inline const char *io_backend_name(io_backend backend)
+{
+  static const char *names[] = {"sync", "threads", "io_uring"};
+  return names[backend];
+}
+
+#endif
@@ -0,0 +1,795 @@
+#ifndef QUERY_HPP
+#define QUERY_HPP
+
+#include "btree.hpp"
+#include "filter.hpp"
+#include "hash_index.hpp"
+#include "row.hpp"
+#include <ctype.h>
+#include <errno.h>
+#include <string>
+#include <strings.h>
+
+/*
+ * A small query layer for `select a, b from rows where ...`.
+ *
+ * The where clause is parsed into an expression tree over the columns of
+ * Row: comparisons (=, !=, <>, <, <=, >, >=) of a column with an integer,
+ * `column [not] in (v, ...)`, `column [not] between lo and hi`, and, or,
+ * not and parentheses. An empty clause selects every row.
+ *
+ * The planner turns the comparisons of the indexed column that are part of
+ * the top level conjunction into the bounds of a B+-tree range scan. The
+ * rest of the clause is evaluated on batches of rows, one column and one
+ * operator at a time, by the bitmap kernels of filter.hpp. A table scan
+ * runs them in place over the columns of a column_table.
+ *
+ * An equality or in-list on the column of the hash index is answered by
+ * probing it instead. With a range on the tree as well, the two are
+ * intersected on row ids, so the rows outside of either are never read.
+ */
+
+// number of rows evaluated at a time
+#define QUERY_BATCH 1024
+
+enum column_id
+{
+  COL_A,
+  COL_B,
+  NUM_COLUMNS
+};
+
+enum expr_kind
+{
+  EXPR_TRUE,
+  EXPR_CMP,
+  EXPR_IN,
+  EXPR_BETWEEN,
+  EXPR_AND,
+  EXPR_OR,
+  EXPR_NOT
+};
+
+enum cmp_op
+{
+  OP_EQ,
+  OP_NE,
+  OP_LT,
+  OP_LE,
+  OP_GT,
+  OP_GE
+};
+
+static const char *column_name(column_id column)
+{
+  return column == COL_A ? "a" : "b";
+}
+
+static const char *cmp_op_name(cmp_op op)
+{
+  static const char *names[] = {"=", "!=", "<", "<=", ">", ">="};
+  return names[op];
+}
+
+class expr
+{
+public:
+  expr_kind kind;
+  column_id column;        // EXPR_CMP, EXPR_IN
+  cmp_op op;               // EXPR_CMP
+  int64_t value;           // EXPR_CMP
+  vector<int64_t> values;  // EXPR_IN, EXPR_BETWEEN (lo, hi)
+  vector<int> int_values;  // EXPR_IN, the values in the int range
+  vector<expr *> children; // EXPR_AND, EXPR_OR, EXPR_NOT
+
+  expr(expr_kind kind) : kind(kind), column(COL_A), op(OP_EQ), value(0) {}
+
+  ~expr()
+  {
+    for (auto c : children)
+      delete c;
+  }
+
+  string to_string() const
+  {
+    string s;
+    switch (kind)
+    {
+    case EXPR_TRUE:
+      return "true";
+    case EXPR_CMP:
+      return string(column_name(column)) + " " + cmp_op_name(op) + " " +
+             std::to_string(value);
+    case EXPR_IN:
+      s = string(column_name(column)) + " in (";
+      for (size_t i = 0; i < values.size(); i++)
+        s += (i ? ", " : "") + std::to_string(values[i]);
+      return s + ")";
+    case EXPR_BETWEEN:
+      return string(column_name(column)) + " between " +
+             std::to_string(values[0]) + " and " + std::to_string(values[1]);
+    case EXPR_NOT:
+      return "not " + children[0]->to_string();
+    default:
+      for (size_t i = 0; i < children.size(); i++)
+        s += (i ? (kind == EXPR_AND ? " and " : " or ") : "") +
+             children[i]->to_string();
+      return "(" + s + ")";
+    }
+  }
+};
+
+/*
+ * Recursive descent parser of the where clause:
+ *
+ *   or_expr  := and_expr { "or" and_expr }
+ *   and_expr := not_expr { "and" not_expr }
+ *   not_expr := "not" not_expr | "(" or_expr ")" | predicate
+ *   predicate := column op integer
+ *              | column ["not"] "in" "(" integer { "," integer } ")"
+ *              | column ["not"] "between" integer "and" integer
+ */
+class where_parser
+{
+private:
+  const string &text;
+  size_t pos;
+  string error;
+
+  void skip_spaces()
+  {
+    while (pos < text.size() && isspace((unsigned char)text[pos]))
+      pos++;
+  }
+
+  bool fail(const string &message)
+  {
+    if (error.empty())
+      error = message + " at offset " + std::to_string(pos);
+    return false;
+  }
+
+  // consumes the keyword if it is the next word, case insensitive
+  bool keyword(const char *word)
+  {
+    skip_spaces();
+    size_t len = strlen(word);
+    if (text.size() - pos < len || strncasecmp(text.c_str() + pos, word, len))
+      return false;
+    if (pos + len < text.size() &&
+        (isalnum((unsigned char)text[pos + len]) || text[pos + len] == '_'))
+      return false;
+    pos += len;
+    return true;
+  }
+
+  bool symbol(const char *sym)
+  {
+    skip_spaces();
+    size_t len = strlen(sym);
+    if (text.compare(pos, len, sym) != 0)
+      return false;
+    pos += len;
+    return true;
+  }
+
+  bool integer(int64_t &value)
+  {
+    skip_spaces();
+    const char *begin = text.c_str() + pos;
+    char *end;
+    errno = 0;
+    long long v = strtoll(begin, &end, 10);
+    if (end == begin)
+      return fail("expected an integer");
+    if (errno == ERANGE)
+      return fail("integer out of range");
+    pos += end - begin;
+    value = v;
+    return true;
+  }
+
+  bool column(column_id &col)
+  {
+    if (keyword("a"))
+      col = COL_A;
+    else if (keyword("b"))
+      col = COL_B;
+    else
+      return fail("expected a column (a or b)");
+    return true;
+  }
+
+  bool comparison(cmp_op &op)
+  {
+    // the two character operators first
+    if (symbol("<=")) op = OP_LE;
+    else if (symbol(">=")) op = OP_GE;
+    else if (symbol("!=") || symbol("<>")) op = OP_NE;
+    else if (symbol("==") || symbol("=")) op = OP_EQ;
+    else if (symbol("<")) op = OP_LT;
+    else if (symbol(">")) op = OP_GT;
+    else
+      return fail("expected a comparison operator");
+    return true;
+  }
+
+  static expr *cmp(column_id col, cmp_op op, int64_t value)
+  {
+    expr *e = new expr(EXPR_CMP);
+    e->column = col;
+    e->op = op;
+    e->value = value;
+    return e;
+  }
+
+  static expr *negate(expr *e)
+  {
+    expr *n = new expr(EXPR_NOT);
+    n->children.push_back(e);
+    return n;
+  }
+
+  expr *predicate()
+  {
+    column_id col = COL_A;
+    if (!column(col))
+      return nullptr;
+
+    bool negated = keyword("not");
+    if (keyword("in"))
+    {
+      expr *e = new expr(EXPR_IN);
+      e->column = col;
+      bool ok = symbol("(") || fail("expected (");
+      while (ok)
+      {
+        int64_t v;
+        ok = integer(v);
+        if (ok)
+        {
+          e->values.push_back(v);
+          // the values outside of the int range never match a column
+          if (v >= INT_MIN && v <= INT_MAX)
+            e->int_values.push_back((int)v);
+        }
+        if (!symbol(","))
+          break;
+      }
+      if (!ok || !symbol(")"))
+      {
+        fail("expected )");
+        delete e;
+        return nullptr;
+      }
+      return negated ? negate(e) : e;
+    }
+    if (keyword("between"))
+    {
+      int64_t lo, hi;
+      if (!integer(lo))
+        return nullptr;
+      if (!keyword("and"))
+      {
+        fail("expected and");
+        return nullptr;
+      }
+      if (!integer(hi))
+        return nullptr;
+      expr *e = new expr(EXPR_BETWEEN);
+      e->column = col;
+      e->values.push_back(lo);
+      e->values.push_back(hi);
+      return negated ? negate(e) : e;
+    }
+    if (negated)
+    {
+      fail("expected in or between");
+      return nullptr;
+    }
+
+    cmp_op op = OP_EQ;
+    int64_t value;
+    if (!comparison(op) || !integer(value))
+      return nullptr;
+    return cmp(col, op, value);
+  }
+
+  expr *not_expr()
+  {
+    if (keyword("not"))
+    {
+      expr *e = not_expr();
+      return e ? negate(e) : nullptr;
+    }
+    if (symbol("("))
+    {
+      expr *e = or_expr();
+      if (e && !symbol(")"))
+      {
+        fail("expected )");
+        delete e;
+        return nullptr;
+      }
+      return e;
+    }
+    return predicate();
+  }
+
+  // parses term { word term } into one node of the given kind
+  template <typename Term>
+  expr *chain(expr_kind kind, const char *word, Term term)
+  {
+    expr *first = term();
+    if (!first || !keyword(word))
+      return first;
+
+    expr *e = new expr(kind);
+    e->children.push_back(first);
+    do
+    {
+      expr *next = term();
+      if (!next)
+      {
+        delete e;
+        return nullptr;
+      }
+      e->children.push_back(next);
+    } while (keyword(word));
+    return e;
+  }
+
+  expr *and_expr()
+  {
+    return chain(EXPR_AND, "and", [this]() { return not_expr(); });
+  }
+
+  expr *or_expr()
+  {
+    return chain(EXPR_OR, "or", [this]() { return and_expr(); });
+  }
+
+public:
+  where_parser(const string &text) : text(text), pos(0) {}
+
+  // Returns the expression tree of the clause, or nullptr and sets error.
+  expr *parse(string &err)
+  {
+    skip_spaces();
+    if (pos == text.size())
+      return new expr(EXPR_TRUE);
+
+    expr *e = or_expr();
+    skip_spaces();
+    if (e && pos != text.size())
+    {
+      fail("unexpected input");
+      delete e;
+      e = nullptr;
+    }
+    err = error;
+    return e;
+  }
+};
+
+static inline expr *parse_where(const string &text, string &error)
+{
+  where_parser parser(text);
+  return parser.parse(error);
+}
+
+// evaluates e on one row, branching on every node
+static bool eval_row(const expr *e, const Row *row)
+{
+  int64_t x = e->column == COL_A ? row->a : row->b;
+  switch (e->kind)
+  {
+  case EXPR_TRUE:
+    return true;
+  case EXPR_CMP:
+    switch (e->op)
+    {
+    case OP_EQ:
+      return x == e->value;
+    case OP_NE:
+      return x != e->value;
+    case OP_LT:
+      return x < e->value;
+    case OP_LE:
+      return x <= e->value;
+    case OP_GT:
+      return x > e->value;
+    default:
+      return x >= e->value;
+    }
+  case EXPR_IN:
+    return std::find(e->values.begin(), e->values.end(), x) != e->values.end();
+  case EXPR_BETWEEN:
+    return x >= e->values[0] && x <= e->values[1];
+  case EXPR_AND:
+    for (auto c : e->children)
+      if (!eval_row(c, row))
+        return false;
+    return true;
+  case EXPR_OR:
+    for (auto c : e->children)
+      if (eval_row(c, row))
+        return true;
+    return false;
+  default:
+    return !eval_row(e->children[0], row);
+  }
+}
+
+// the rows of the table stored column by column, rows[i] is row i
+class column_table
+{
+public:
+  const Row *rows;
+  int nrows;
+  vector<int> columns[NUM_COLUMNS];
+
+  column_table(const Row *rows, int nrows)
+      : rows(rows), nrows(nrows)
+  {
+    columns[COL_A].resize(nrows);
+    columns[COL_B].resize(nrows);
+    for (int i = 0; i < nrows; i++)
+    {
+      columns[COL_A][i] = rows[i].a;
+      columns[COL_B][i] = rows[i].b;
+    }
+  }
+};
+
+// the rows found by an index scan, gathered column by column
+class row_batch
+{
+public:
+  const Row *rows[QUERY_BATCH];
+  int columns[NUM_COLUMNS][QUERY_BATCH];
+  int n;
+
+  row_batch() : n(0) {}
+
+  bool full() const { return n == QUERY_BATCH; }
+
+  void add(const Row *row) { rows[n++] = row; }
+
+  void gather()
+  {
+    for (int i = 0; i < n; i++)
+    {
+      columns[COL_A][i] = rows[i]->a;
+      columns[COL_B][i] = rows[i]->b;
+    }
+  }
+};
+
+// Sets bit i of bits when row i of the n rows of columns matches e. Every
+// node is one kernel over a whole column, and/or/not combine the bitmaps.
+static void eval_filter(const expr *e, const int *const *columns, int n,
+                        uint64_t *bits)
+{
+  uint64_t tmp[QUERY_BATCH / 64];
+  // the columns are ints, so v - 1 and v + 1 cannot overflow any more
+  int64_t v = std::min(std::max(e->value, (int64_t)INT_MIN - 1),
+                       (int64_t)INT_MAX + 1);
+  switch (e->kind)
+  {
+  case EXPR_TRUE:
+    bitmap_fill(bits, n);
+    break;
+  case EXPR_CMP:
+  {
+    const int *col = columns[e->column];
+    switch (e->op)
+    {
+    case OP_EQ:
+      filter_eq(col, n, v, bits);
+      break;
+    case OP_NE:
+      filter_eq(col, n, v, bits);
+      bitmap_not(bits, n);
+      break;
+    case OP_LT:
+      filter_between(col, n, INT_MIN, v - 1, bits);
+      break;
+    case OP_LE:
+      filter_between(col, n, INT_MIN, v, bits);
+      break;
+    case OP_GT:
+      filter_between(col, n, v + 1, INT_MAX, bits);
+      break;
+    case OP_GE:
+      filter_between(col, n, v, INT_MAX, bits);
+      break;
+    }
+    break;
+  }
+  case EXPR_BETWEEN:
+    filter_between(columns[e->column], n, e->values[0], e->values[1], bits);
+    break;
+  case EXPR_IN:
+    filter_in(columns[e->column], n, e->int_values.data(),
+              (int)e->int_values.size(), bits);
+    break;
+  case EXPR_AND:
+  case EXPR_OR:
+    eval_filter(e->children[0], columns, n, bits);
+    for (size_t c = 1; c < e->children.size(); c++)
+    {
+      eval_filter(e->children[c], columns, n, tmp);
+      if (e->kind == EXPR_AND)
+        bitmap_and(bits, tmp, n);
+      else
+        bitmap_or(bits, tmp, n);
+    }
+    break;
+  case EXPR_NOT:
+    eval_filter(e->children[0], columns, n, bits);
+    bitmap_not(bits, n);
+    break;
+  }
+}
+
+class query
+{
+private:
+  expr *where;
+  column_id index_column;
+  column_id hash_column;
+
+  // the plan: a range scan of the index and/or a probe of the hash index,
+  // or a scan of the table
+  bool use_index;
+  entry_key_t min, max;
+  bool min_inclusive, max_inclusive;
+  const expr *hash_probe;        // the = or in answered by the hash index
+  vector<const expr *> residual; // conjuncts not covered by the scan
+
+  // the conjuncts of the top level and
+  static void conjuncts(const expr *e, vector<const expr *> &out)
+  {
+    if (e->kind == EXPR_AND)
+      for (auto c : e->children)
+        conjuncts(c, out);
+    else if (e->kind != EXPR_TRUE)
+      out.push_back(e);
+  }
+
+  void raise_min(entry_key_t v, bool inclusive)
+  {
+    if (v > min || (v == min && !inclusive))
+    {
+      min = v;
+      min_inclusive = inclusive;
+    }
+  }
+
+  void lower_max(entry_key_t v, bool inclusive)
+  {
+    if (v < max || (v == max && !inclusive))
+    {
+      max = v;
+      max_inclusive = inclusive;
+    }
+  }
+
+  bool in_range(int64_t v) const
+  {
+    return (v > min || (min_inclusive && v == min)) &&
+           (v < max || (max_inclusive && v == max));
+  }
+
+  // takes the first = or in of the hash column as the probe of the hash
+  // index, it is not evaluated on the rows then
+  bool absorb_hash(const expr *e)
+  {
+    if (hash_probe != nullptr || e->column != hash_column ||
+        !(e->kind == EXPR_IN || (e->kind == EXPR_CMP && e->op == OP_EQ)))
+      return false;
+    hash_probe = e;
+    return true;
+  }
+
+  // the distinct values of the hash probe
+  vector<int64_t> probe_values() const
+  {
+    vector<int64_t> values = hash_probe->kind == EXPR_IN
+                                 ? hash_probe->values
+                                 : vector<int64_t>(1, hash_probe->value);
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+    return values;
+  }
+
+  // narrows the scan to the conjunct if it is a range of the index column,
+  // returns false if it still has to be evaluated on the rows
+  bool absorb(const expr *e)
+  {
+    if (e->column != index_column)
+      return false;
+    if (e->kind == EXPR_IN)
+    {
+      // the scan covers the values, the list is still checked on the rows
+      raise_min(*std::min_element(e->values.begin(), e->values.end()), true);
+      lower_max(*std::max_element(e->values.begin(), e->values.end()), true);
+      use_index = true;
+      return false;
+    }
+    if (e->kind == EXPR_BETWEEN)
+    {
+      raise_min(e->values[0], true);
+      lower_max(e->values[1], true);
+      use_index = true;
+      return true;
+    }
+    if (e->kind != EXPR_CMP)
+      return false;
+
+    switch (e->op)
+    {
+    case OP_EQ:
+      raise_min(e->value, true);
+      lower_max(e->value, true);
+      break;
+    case OP_LT:
+      lower_max(e->value, false);
+      break;
+    case OP_LE:
+      lower_max(e->value, true);
+      break;
+    case OP_GT:
+      raise_min(e->value, false);
+      break;
+    case OP_GE:
+      raise_min(e->value, true);
+      break;
+    default:
+      return false;
+    }
+    use_index = true;
+    return true;
+  }
+
+  // evaluates the residual on n rows and calls emit(i) for the matching ones
+  template <typename Emit>
+  void filter(const int *const *columns, int n, Emit emit) const
+  {
+    uint64_t bits[QUERY_BATCH / 64], tmp[QUERY_BATCH / 64];
+    bitmap_fill(bits, n);
+    for (auto e : residual)
+    {
+      eval_filter(e, columns, n, tmp);
+      bitmap_and(bits, tmp, n);
+    }
+    bitmap_for_each(bits, n, emit);
+  }
+
+  template <typename Emit> void flush(row_batch &batch, Emit &emit) const
+  {
+    const int *columns[NUM_COLUMNS] = {batch.columns[COL_A],
+                                       batch.columns[COL_B]};
+    batch.gather();
+    filter(columns, batch.n, [&](int i) { emit(batch.rows[i]); });
+    batch.n = 0;
+  }
+
+public:
+  // takes the ownership of where. index_column is the column indexed by the
+  // tree and hash_column the one of the hash index the query runs with,
+  // NUM_COLUMNS if there is none.
+  query(expr *where, column_id index_column,
+        column_id hash_column = NUM_COLUMNS)
+      : where(where), index_column(index_column), hash_column(hash_column),
+        use_index(false), min(LLONG_MIN), max(LLONG_MAX),
+        min_inclusive(true), max_inclusive(true), hash_probe(nullptr)
+  {
+    vector<const expr *> all;
+    conjuncts(where, all);
+    for (auto e : all)
+      if (!absorb_hash(e) && !absorb(e))
+        residual.push_back(e);
+  }
+
+  ~query() { delete where; }
+
+  string explain() const
+  {
+    string s;
+    if (use_index)
+      s = string("index range scan ") + column_name(index_column) + " in " +
+          (min_inclusive ? "[" : "(") + std::to_string(min) + ", " +
+          std::to_string(max) + (max_inclusive ? "]" : ")");
+    if (hash_probe)
+      s += string(use_index ? " intersect " : "") + "hash probe " +
+           hash_probe->to_string();
+    if (!use_index && !hash_probe)
+      s = "table scan";
+    for (size_t i = 0; i < residual.size(); i++)
+      s += (i ? " and " : ", filter ") + residual[i]->to_string();
+    return s;
+  }
+
+  // Calls emit(const Row *) for every row of table that matches. bt and hash
+  // index the columns index_column and hash_column of the table, a table
+  // scan filters the columns of the table in place and needs neither.
+  template <typename Emit>
+  void run(btree *bt, const hash_index *hash, const column_table &table,
+           Emit emit) const
+  {
+    if (!use_index && !hash_probe)
+    {
+      for (int base = 0; base < table.nrows; base += QUERY_BATCH)
+      {
+        const int *columns[NUM_COLUMNS] = {
+            table.columns[COL_A].data() + base,
+            table.columns[COL_B].data() + base};
+        filter(columns, std::min(QUERY_BATCH, table.nrows - base),
+               [&](int i) { emit(&table.rows[base + i]); });
+      }
+      return;
+    }
+
+    row_batch *batch = new row_batch();
+    auto add = [&](const Row *row)
+    {
+      batch->add(row);
+      if (batch->full())
+        flush(*batch, emit);
+    };
+    vector<int> probed;
+    if (hash_probe)
+      for (auto v : probe_values())
+        hash->probe(v, [&](int id) { probed.push_back(id); });
+
+    if (!use_index)
+    {
+      for (auto id : probed)
+        add(&table.rows[id]);
+    }
+    else if (!hash_probe)
+    {
+      bt->btree_scan(min, max, min_inclusive, max_inclusive,
+                     [&](entry_key_t, char *ptr) -> bool
+                     {
+                       add((const Row *)ptr);
+                       return true;
+                     });
+    }
+    else if ((long)probed.size() * 64 < table.nrows)
+    {
+      // few probed rows: check the range on their index column instead of
+      // scanning it, in the order of the index
+      const int *col = table.columns[index_column].data();
+      probed.erase(std::remove_if(probed.begin(), probed.end(),
+                                  [&](int id) { return !in_range(col[id]); }),
+                   probed.end());
+      std::sort(probed.begin(), probed.end(),
+                [&](int x, int y) { return col[x] < col[y]; });
+      for (auto id : probed)
+        add(&table.rows[id]);
+    }
+    else
+    {
+      // the probed rows as a bitmap over the table: the range scan only keeps
+      // the entries whose row is set and never reads the others
+      vector<uint64_t> rows(bitmap_words(table.nrows), 0);
+      for (auto id : probed)
+        rows[id / 64] |= 1ULL << (id % 64);
+      bt->btree_scan(min, max, min_inclusive, max_inclusive,
+                     [&](entry_key_t, char *ptr) -> bool
+                     {
+                       long id = (const Row *)ptr - table.rows;
+                       if (rows[id / 64] >> (id % 64) & 1)
+                         add((const Row *)ptr);
+                       return true;
+                     });
+    }
+    flush(*batch, emit);
+    delete batch;
+  }
+};
+
+#endif
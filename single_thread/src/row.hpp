@@ -0,0 +1,11 @@
+#ifndef ROW_HPP
+#define ROW_HPP
+
+// a row of the table, b is indexed by the B+-tree
+typedef struct Row
+{
+    int a;
+    int b;
+} Row;
+
+#endif
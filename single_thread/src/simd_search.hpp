@@ -0,0 +1,159 @@
+#ifndef SIMD_SEARCH_HPP
+#define SIMD_SEARCH_HPP
+
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Rank kernels over the sorted keys of a page: they count the keys less than
+ * key (or less than or equal to key if inclusive is set) among the first n
+ * keys, where the keys are every stride-th int64 starting at keys.
+ *
+ * The widest kernel the cpu supports is picked once at startup through cpuid,
+ * so the binary does not have to be built with -mavx2.
+ */
+
+// above this many keys the window is first narrowed with a binary search
+#define SIMD_RANK_WINDOW 32
+
+enum rank_isa
+{
+  RANK_SCALAR,
+  RANK_SSE42,
+  RANK_AVX2
+};
+
+static inline rank_isa detect_rank_isa()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return RANK_AVX2;
+  if (__builtin_cpu_supports("sse4.2"))
+    return RANK_SSE42;
+#endif
+  return RANK_SCALAR;
+}
+
+static const rank_isa cpu_rank_isa = detect_rank_isa();
+
+static inline const char *rank_isa_name(rank_isa isa)
+{
+  switch (isa)
+  {
+  case RANK_AVX2:
+    return "avx2";
+  case RANK_SSE42:
+    return "sse4.2";
+  default:
+    return "scalar";
+  }
+}
+
+template <int stride>
+static inline int rank_scalar(const int64_t *keys, int n, int64_t key,
+                              bool inclusive)
+{
+  int r = 0;
+  while (r < n)
+  {
+    int64_t k = keys[r * stride];
+    if (!(k < key || (inclusive && k == key)))
+      break;
+    ++r;
+  }
+  return r;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 2 keys per compare
+template <int stride>
+__attribute__((target("sse4.2"))) static int
+rank_sse42(const int64_t *keys, int n, int64_t key, bool inclusive)
+{
+  const __m128i vkey = _mm_set1_epi64x(key);
+  int r = 0;
+  for (; r + 2 <= n; r += 2)
+  {
+    __m128i k;
+    if (stride == 1)
+      k = _mm_loadu_si128((const __m128i *)(keys + r));
+    else
+      k = _mm_unpacklo_epi64(
+          _mm_loadu_si128((const __m128i *)(keys + r * stride)),
+          _mm_loadu_si128((const __m128i *)(keys + (r + 1) * stride)));
+
+    // inclusive: !(k > key), otherwise: key > k
+    __m128i m = inclusive ? _mm_cmpgt_epi64(k, vkey) : _mm_cmpgt_epi64(vkey, k);
+    int bits = _mm_movemask_pd(_mm_castsi128_pd(m));
+    if (inclusive)
+      bits ^= 0x3;
+
+    if (bits != 0x3)
+      return r + __builtin_popcount(bits);
+  }
+  return r + rank_scalar<stride>(keys + r * stride, n - r, key, inclusive);
+}
+
+// 4 keys per compare
+template <int stride>
+__attribute__((target("avx2"))) static int
+rank_avx2(const int64_t *keys, int n, int64_t key, bool inclusive)
+{
+  const __m256i vkey = _mm256_set1_epi64x(key);
+  int r = 0;
+  for (; r + 4 <= n; r += 4)
+  {
+    __m256i k;
+    if (stride == 1)
+      k = _mm256_loadu_si256((const __m256i *)(keys + r));
+    else // {k0, p0, k1, p1} {k2, p2, k3, p3} -> {k0, k2, k1, k3}
+      k = _mm256_unpacklo_epi64(
+          _mm256_loadu_si256((const __m256i *)(keys + r * stride)),
+          _mm256_loadu_si256((const __m256i *)(keys + (r + 2) * stride)));
+
+    __m256i m =
+        inclusive ? _mm256_cmpgt_epi64(k, vkey) : _mm256_cmpgt_epi64(vkey, k);
+    int bits = _mm256_movemask_pd(_mm256_castsi256_pd(m));
+    if (inclusive)
+      bits ^= 0xf;
+
+    // the keys are sorted, so the lane order does not matter for the count
+    if (bits != 0xf)
+      return r + __builtin_popcount(bits);
+  }
+  return r + rank_scalar<stride>(keys + r * stride, n - r, key, inclusive);
+}
+#endif
+
+template <int stride>
+static inline int simd_rank(const int64_t *keys, int n, int64_t key,
+                            bool inclusive, rank_isa isa = cpu_rank_isa)
+{
+  int lo = 0;
+  while (n > SIMD_RANK_WINDOW)
+  {
+    int half = n >> 1;
+    int64_t k = keys[(lo + half) * stride];
+    bool right = (k < key) | (inclusive & (k == key));
+    lo = right ? lo + half + 1 : lo;
+    n = right ? n - half - 1 : half;
+  }
+
+  keys += lo * stride;
+  switch (isa)
+  {
+#if defined(__x86_64__) || defined(__i386__)
+  case RANK_AVX2:
+    return lo + rank_avx2<stride>(keys, n, key, inclusive);
+  case RANK_SSE42:
+    return lo + rank_sse42<stride>(keys, n, key, inclusive);
+#endif
+  default:
+    return lo + rank_scalar<stride>(keys, n, key, inclusive);
+  }
+}
+
+#endif
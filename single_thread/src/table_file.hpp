@@ -0,0 +1,428 @@
+#ifndef TABLE_FILE_HPP
+#define TABLE_FILE_HPP
+
+#include "row.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Binary table files: a 64 byte header followed by the values, native (little
+ * endian) ints from a multiple of 64 bytes on. In the columns layout there
+ * is one block of num_rows values per column, every block 64 byte aligned.
+ * In the rows layout the values are one array of rows, so a Row of the file
+ * can be used in place once it is mapped. The checksum adds up one term per
+ * value, whatever the layout, so the values can be checked in any order and
+ * by any number of threads.
+ */
+
+#define TABLE_FILE_MAGIC "DBETABLE"
+#define TABLE_FILE_VERSION 1
+
+// columns of a Row: a, b
+const int row_columns = 2;
+
+enum table_layout
+{
+  TABLE_COLUMNS = 0,
+  TABLE_ROWS = 1
+};
+
+struct table_file_header
+{
+  char magic[8];          // TABLE_FILE_MAGIC
+  uint32_t version;       // TABLE_FILE_VERSION
+  uint32_t num_columns;
+  uint64_t num_rows;
+  uint64_t checksum;      // sum of table_checksum_term over all the values
+  uint64_t column_offset; // of the first value
+  uint64_t column_stride; // bytes from one column block to the next, 0 for rows
+  uint32_t layout;        // table_layout
+  char reserved[12];
+};
+static_assert(sizeof(table_file_header) == 64, "the header is 64 bytes");
+
+static inline uint64_t mix64(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+// the term of the value at position column * num_rows + row
+static inline uint64_t table_checksum_term(uint64_t position, int value)
+{
+  return mix64(position * 0x9E3779B97F4A7C15ULL + (uint32_t)value);
+}
+
+// the terms of n values from position first on
+static inline uint64_t table_checksum(const int *values, size_t n,
+                                      uint64_t first)
+{
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; i++)
+    sum += table_checksum_term(first + i, values[i]);
+  return sum;
+}
+
+// a header for num_columns columns of num_rows values
+static inline table_file_header table_header(uint32_t num_columns,
+                                             uint64_t num_rows,
+                                             table_layout layout)
+{
+  table_file_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TABLE_FILE_MAGIC, sizeof(hdr.magic));
+  hdr.version = TABLE_FILE_VERSION;
+  hdr.num_columns = num_columns;
+  hdr.num_rows = num_rows;
+  hdr.column_offset = sizeof(table_file_header);
+  if (layout == TABLE_COLUMNS)
+    hdr.column_stride = (num_rows * sizeof(int) + 63) / 64 * 64;
+  hdr.layout = layout;
+  return hdr;
+}
+
+// Checks the header of a file of file_size bytes that should hold
+// num_columns columns, sets error otherwise.
+static inline bool check_table_header(const table_file_header &hdr,
+                                      uint64_t file_size, uint32_t num_columns,
+                                      std::string &error)
+{
+  uint64_t size = hdr.layout == TABLE_COLUMNS
+                      ? hdr.column_stride * num_columns
+                      : hdr.num_rows * num_columns * sizeof(int);
+  if (memcmp(hdr.magic, TABLE_FILE_MAGIC, sizeof(hdr.magic)) != 0)
+    error = "not a table file";
+  else if (hdr.version != TABLE_FILE_VERSION)
+    error = "unsupported table file version " + std::to_string(hdr.version);
+  else if (hdr.num_columns != num_columns)
+    error = "expected " + std::to_string(num_columns) + " columns, found " +
+            std::to_string(hdr.num_columns);
+  else if ((hdr.layout != TABLE_COLUMNS && hdr.layout != TABLE_ROWS) ||
+           hdr.column_offset % 64 != 0 || hdr.column_stride % 64 != 0 ||
+           (hdr.layout == TABLE_COLUMNS &&
+            hdr.column_stride < hdr.num_rows * sizeof(int)) ||
+           hdr.column_stride > file_size ||
+           hdr.num_rows > file_size / sizeof(int) ||
+           hdr.column_offset > file_size ||
+           size > file_size - hdr.column_offset)
+    error = "truncated or corrupt table file";
+  else
+    return true;
+  return false;
+}
+
+// Writes nrows rows whose column c is column(c, i) to path in the given
+// layout, sets error if the file cannot be written.
+template <typename Column>
+bool write_table(const char *path, uint32_t num_columns, size_t nrows,
+                 Column column, std::string &error,
+                 table_layout layout = TABLE_COLUMNS)
+{
+  FILE *out = fopen(path, "wb");
+  if (out == NULL)
+  {
+    error = std::string("cannot open ") + path + ": " + strerror(errno);
+    return false;
+  }
+
+  table_file_header hdr = table_header(num_columns, nrows, layout);
+  std::vector<int> buf(64 * 1024);
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+  if (layout == TABLE_ROWS)
+  {
+    size_t per_chunk = buf.size() / num_columns;
+    for (size_t begin = 0; begin < nrows && ok; begin += per_chunk)
+    {
+      size_t n = std::min(per_chunk, nrows - begin);
+      for (size_t i = 0; i < n; i++)
+      {
+        for (uint32_t c = 0; c < num_columns; c++)
+        {
+          buf[i * num_columns + c] = column(c, begin + i);
+          hdr.checksum +=
+              table_checksum_term(c * nrows + begin + i, buf[i * num_columns + c]);
+        }
+      }
+      ok = fwrite(buf.data(), sizeof(int), n * num_columns, out) ==
+           n * num_columns;
+    }
+  }
+  for (uint32_t c = 0; c < num_columns && ok && layout == TABLE_COLUMNS; c++)
+  {
+    for (size_t begin = 0; begin < nrows && ok; begin += buf.size())
+    {
+      size_t n = std::min(buf.size(), nrows - begin);
+      for (size_t i = 0; i < n; i++)
+        buf[i] = column(c, begin + i);
+      hdr.checksum += table_checksum(buf.data(), n, c * nrows + begin);
+      ok = fwrite(buf.data(), sizeof(int), n, out) == n;
+    }
+    // zeros up to the next block
+    size_t padding = hdr.column_stride - nrows * sizeof(int);
+    static const char zeros[64] = {0};
+    ok = ok && fwrite(zeros, 1, padding, out) == padding;
+  }
+  // the header again, now with the checksum
+  ok = ok && fseek(out, 0, SEEK_SET) == 0 &&
+       fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+  ok = fclose(out) == 0 && ok;
+  if (!ok)
+    error = std::string("cannot write ") + path;
+  return ok;
+}
+
+static inline bool write_table(const char *path, const Row *rows,
+                               size_t nrows, std::string &error,
+                               table_layout layout = TABLE_COLUMNS)
+{
+  return write_table(path, row_columns, nrows,
+                     [&](uint32_t c, size_t i)
+                     { return c == 0 ? rows[i].a : rows[i].b; },
+                     error, layout);
+}
+
+// Opens the table at path and reads its header, which must describe
+// num_columns columns. Returns NULL and sets error otherwise.
+static inline FILE *open_table(const char *path, uint32_t num_columns,
+                               table_file_header &hdr, std::string &error)
+{
+  FILE *in = fopen(path, "rb");
+  if (in == NULL)
+  {
+    error = std::string("cannot open ") + path + ": " + strerror(errno);
+    return NULL;
+  }
+  if (fread(&hdr, sizeof(hdr), 1, in) != 1 || fseek(in, 0, SEEK_END) != 0)
+    error = "truncated or corrupt table file";
+  else if (check_table_header(hdr, ftell(in), num_columns, error))
+    return in;
+  error = std::string(path) + ": " + error;
+  fclose(in);
+  return NULL;
+}
+
+// Reads the values of an open table in the order they are stored, calls
+// store(column, row, value) for each and checks them against the checksum.
+template <typename Store>
+bool read_table(FILE *in, const table_file_header &hdr, const char *path,
+                Store store, std::string &error)
+{
+  uint32_t num_columns = hdr.num_columns;
+  size_t nrows = hdr.num_rows;
+  std::vector<int> buf(64 * 1024);
+  bool ok = true;
+  uint64_t checksum = 0;
+  if (hdr.layout == TABLE_ROWS)
+  {
+    size_t per_chunk = buf.size() / num_columns;
+    ok = fseek(in, hdr.column_offset, SEEK_SET) == 0;
+    for (size_t begin = 0; begin < nrows && ok; begin += per_chunk)
+    {
+      size_t n = std::min(per_chunk, nrows - begin);
+      ok = fread(buf.data(), sizeof(int), n * num_columns, in) ==
+           n * num_columns;
+      for (size_t i = 0; i < n; i++)
+      {
+        for (uint32_t c = 0; c < num_columns; c++)
+        {
+          int value = buf[i * num_columns + c];
+          checksum += table_checksum_term(c * nrows + begin + i, value);
+          store(c, begin + i, value);
+        }
+      }
+    }
+  }
+  for (uint32_t c = 0; c < num_columns && ok && hdr.layout == TABLE_COLUMNS;
+       c++)
+  {
+    ok = fseek(in, hdr.column_offset + c * hdr.column_stride, SEEK_SET) == 0;
+    for (size_t begin = 0; begin < nrows && ok; begin += buf.size())
+    {
+      size_t n = std::min(buf.size(), nrows - begin);
+      ok = fread(buf.data(), sizeof(int), n, in) == n;
+      checksum += table_checksum(buf.data(), n, c * nrows + begin);
+      for (size_t i = 0; i < n; i++)
+        store(c, begin + i, buf[i]);
+    }
+  }
+  fclose(in);
+  if (!ok || checksum != hdr.checksum)
+  {
+    error = std::string(path) + (ok ? ": checksum mismatch" : ": read error");
+    return false;
+  }
+  return true;
+}
+
+// Reads the num_columns columns of the table at path into columns[0..),
+// sets error if it cannot be read or does not match its checksum.
+static inline bool load_table(const char *path, std::vector<int> *columns,
+                              uint32_t num_columns, std::string &error)
+{
+  table_file_header hdr;
+  FILE *in = open_table(path, num_columns, hdr, error);
+  if (in == NULL)
+    return false;
+
+  for (uint32_t c = 0; c < num_columns; c++)
+    columns[c].resize(hdr.num_rows);
+  return read_table(in, hdr, path,
+                    [&](uint32_t c, size_t i, int value)
+                    { columns[c][i] = value; },
+                    error);
+}
+
+// Reads the table at path into rows.
+static inline bool load_table(const char *path, std::vector<Row> &rows,
+                              std::string &error)
+{
+  table_file_header hdr;
+  FILE *in = open_table(path, row_columns, hdr, error);
+  if (in == NULL)
+    return false;
+
+  rows.resize(hdr.num_rows);
+  return read_table(in, hdr, path,
+                    [&](uint32_t c, size_t i, int value)
+                    {
+                      if (c == 0)
+                        rows[i].a = value;
+                      else
+                        rows[i].b = value;
+                    },
+                    error);
+}
+
+/*
+ * A table file mapped read-only into memory. Opening it only maps the file
+ * and checks the header, the pages are read when they are first touched, so
+ * it takes the same time whatever the size of the table. The rows of a file
+ * in the rows layout, and the columns of one in the columns layout, are used
+ * in place.
+ */
+class mapped_table
+{
+private:
+  char *base;
+  size_t length;
+  table_file_header hdr;
+
+public:
+  mapped_table() : base(nullptr), length(0)
+  {
+    memset(&hdr, 0, sizeof(hdr));
+  }
+  ~mapped_table() { close(); }
+
+  mapped_table(const mapped_table &) = delete;
+  mapped_table &operator=(const mapped_table &) = delete;
+
+  // maps the table at path, which must have num_columns columns
+  bool open(const char *path, std::string &error,
+            uint32_t num_columns = row_columns)
+  {
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+    {
+      error = std::string("cannot open ") + path + ": " + strerror(errno);
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(hdr))
+    {
+      error = std::string(path) + ": truncated or corrupt table file";
+      ::close(fd);
+      return false;
+    }
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // the mapping keeps the file
+    if (p == MAP_FAILED)
+    {
+      error = std::string("cannot map ") + path + ": " + strerror(errno);
+      return false;
+    }
+    base = (char *)p;
+    length = st.st_size;
+    memcpy(&hdr, base, sizeof(hdr));
+    if (!check_table_header(hdr, length, num_columns, error))
+    {
+      error = std::string(path) + ": " + error;
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close()
+  {
+    if (base != nullptr)
+      munmap(base, length);
+    base = nullptr;
+    length = 0;
+    memset(&hdr, 0, sizeof(hdr));
+  }
+
+  // MADV_SEQUENTIAL before a scan, MADV_RANDOM before point lookups,
+  // MADV_WILLNEED to read the whole table ahead
+  void advise(int advice) { madvise(base, length, advice); }
+
+  // 0 and nullptr while no table is mapped
+  size_t num_rows() const { return base != nullptr ? hdr.num_rows : 0; }
+  table_layout layout() const { return (table_layout)hdr.layout; }
+
+  // the rows of a table in the rows layout, nullptr in the columns layout
+  const Row *rows() const
+  {
+    return base != nullptr && hdr.layout == TABLE_ROWS
+               ? (const Row *)(base + hdr.column_offset)
+               : nullptr;
+  }
+
+  // column c of a table in the columns layout, nullptr in the rows layout
+  const int *column(uint32_t c) const
+  {
+    return base != nullptr && hdr.layout == TABLE_COLUMNS
+               ? (const int *)(base + hdr.column_offset +
+                               c * hdr.column_stride)
+               : nullptr;
+  }
+
+  // Reads every value and compares them with the checksum, sets error if
+  // they do not match. Unlike open() it reads the whole table.
+  bool verify(std::string &error) const
+  {
+    uint64_t checksum = 0;
+    const int *values = (const int *)(base + hdr.column_offset);
+    size_t nrows = hdr.num_rows;
+    for (uint32_t c = 0; c < hdr.num_columns; c++)
+    {
+      if (hdr.layout == TABLE_COLUMNS)
+        checksum += table_checksum(column(c), nrows, c * nrows);
+      else
+      {
+        for (size_t i = 0; i < nrows; i++)
+          checksum += table_checksum_term(c * nrows + i,
+                                          values[i * hdr.num_columns + c]);
+      }
+    }
+    if (checksum != hdr.checksum)
+      error = "checksum mismatch";
+    return checksum == hdr.checksum;
+  }
+};
+
+#endif
@@ -1,64 +1,123 @@
 #include "btree.hpp"
+#include "csv_loader.hpp"
 #include "generateData.hpp"
+#include "query.hpp"
+#include "row.hpp"
+#include "table_file.hpp"
+#include <chrono>
 #include <glog/logging.h>  // yum install glog glog-devel
 #include <gflags/gflags.h> // yum install gflags gflags-devel
 
-static const int START_INDEX = 10;
-static const int END_INDEX = 51;
+DEFINE_string(query, "b > 10 and b < 51 and a in (1000, 2000, 3000)",
+              "where clause of select a, b from rows where ...");
+DEFINE_string(format, "mmap", "format the generated rows are written and read back in: mmap (input.tbl mapped in place), binary (input.tbl) or csv (input.txt, parsed in parallel)");
+DEFINE_uint64(seed, 42, "seed of the generated rows, the same seed gives the same rows");
+DEFINE_string(distribution, "uniform", "distribution of the generated b keys: uniform, zipf, sequential or clustered");
 
-typedef struct Row
+void task(const Row *rows, int nrows, const query &q)
 {
-    int a;
-    int b;
-} Row;
-
-void task(Row *rows, int nrows)
-{
-    // construct b plus tree index
+    // construct b plus tree index bottom-up
     btree *bt = new btree();
+    vector<entry_key_t> keys(nrows);
+    vector<char *> ptrs(nrows);
     for (int i = 0; i < nrows; i++)
     {
-        bt->btree_insert(rows[i].b, (char *)&rows[i]);
+        keys[i] = rows[i].b;
+        ptrs[i] = (char *)&rows[i];
     }
+    bt->btree_bulk_load(keys.data(), ptrs.data(), nrows);
     
     // printf("%d\n", (*(Row*)bt->btree_search(16)).a); // point query
     // printf("%x\n", bt->btree_search(16)); point query
-    unsigned long *bufs = new unsigned long[nrows]{};
-    int offset = 0;
-    bt->btree_search_range(START_INDEX, END_INDEX, bufs, offset);
-    for (int i = 0; i < offset; i++)
-    {
-        auto tmp = (*(Row *)(char *)bufs[i]);
-        if (1000 == tmp.a || 2000 == tmp.a || 3000 == tmp.a)
-            printf("%d %d\n", tmp.a, tmp.b);
-    }
-    delete[] bufs;
+    column_table table(rows, nrows);
+    // hash index on a for the equality and in-list conditions
+    hash_index hash(table.columns[COL_A].data(), nrows);
+
+    LOG(INFO) << "plan: " << q.explain() << endl;
+    q.run(bt, &hash, table,
+          [](const Row *row) { printf("%d %d\n", row->a, row->b); });
     delete bt;
 }
 
 
 int main(int argc, char *argv[])
 {
+    google::ParseCommandLineFlags(&argc, &argv, true);
     google::InitGoogleLogging(argv[0]);
     FLAGS_colorlogtostderr=true;  //set output color
     FLAGS_log_dir = "./logs";  // the logs directory
     LOG(INFO) << "The main started!" << endl;
+
+    string error;
+    expr *where = parse_where(FLAGS_query, error);
+    if (where == nullptr)
+    {
+        fprintf(stderr, "invalid query: %s\n", error.c_str());
+        return 1;
+    }
+    query q(where, COL_B, COL_A);
    
     // 从文件读取大量数据，并保存到 row 数组中
     int num_ways = 10;
     int run_size = 1000;
-    Row rows[num_ways*run_size];
-    generateData(num_ways, run_size);
+    generator_options opt;
+    opt.seed = FLAGS_seed;
+    opt.threads = std::thread::hardware_concurrency();
+    if (!parse_distribution(FLAGS_distribution, &opt.distribution))
+    {
+        fprintf(stderr, "unknown distribution: %s\n", FLAGS_distribution.c_str());
+        return 1;
+    }
+    vector<Row> rows;
+    mapped_table mapped;
+    auto start = std::chrono::steady_clock::now();
+    if (FLAGS_format == "csv")
+    {
+        generateData(num_ways, run_size, opt);
 
-    char input_file[] = "input.txt";
-    FILE *in = openFile(input_file, "r");
-    for(int i = 0 ; i < num_ways * run_size; i++){
-        if(fscanf(in, "%d,%d", &rows[i].a, &rows[i].b) != 2){
-            break;
-	}
+        csv_stats stats;
+        if (!load_csv("input.txt", rows, std::thread::hardware_concurrency(),
+                      &stats, error))
+        {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        LOG(INFO) << "parsed " << stats.rows_per_sec() << " rows/s, "
+                  << stats.mb_per_sec() << " MB/s" << endl;
     }
-    
-    int len = sizeof(rows) / sizeof(rows[0]);
-    task(rows, len);
+    else if (FLAGS_format == "mmap")
+    {
+        // the rows stay in the file, the tree points into the mapping
+        generateTable("input.tbl", num_ways, run_size, TABLE_ROWS, opt);
+        if (!mapped.open("input.tbl", error))
+        {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        // the index and the columns are built in one pass over the rows
+        mapped.advise(MADV_SEQUENTIAL);
+    }
+    else if (FLAGS_format == "binary")
+    {
+        generateTable("input.tbl", num_ways, run_size, TABLE_COLUMNS, opt);
+        if (!load_table("input.tbl", rows, error))
+        {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "unknown format: %s\n", FLAGS_format.c_str());
+        return 1;
+    }
+    const Row *table_rows = mapped.rows() ? mapped.rows() : rows.data();
+    int len = mapped.rows() ? mapped.num_rows() : rows.size();
+    LOG(INFO) << "generated and read " << len << " rows in "
+              << std::chrono::duration<double, std::milli>(
+                     std::chrono::steady_clock::now() - start).count()
+              << " ms" << endl;
+
+    task(table_rows, len, q);
     return 0;
 }